@@ -0,0 +1,119 @@
+#!/bin/sh
+# Benchmarks the builtins of seashell without a terminal.
+#
+# Each scenario pipes RUNS copies of one command into a fresh seashell and
+# reads the latency percentiles back with "stats -j". Results are written to
+# bench/results.json, one scenario per line, and compared to
+# bench/baseline.json when it exists: a p50 more than THRESHOLD percent
+# slower than the baseline is reported as a regression and fails the run.
+#
+# usage: sh bench/bench.sh   (normally through "make bench")
+
+set -e
+
+SEASHELL=${SEASHELL:-./seashell}
+GENCORPUS=${GENCORPUS:-bench/gencorpus}
+WORK=${WORK:-bench/work}
+RUNS=${RUNS:-10}
+SPAWN_RUNS=${SPAWN_RUNS:-500}
+RESULTS=${RESULTS:-bench/results.json}
+BASELINE=${BASELINE-bench/baseline.json}
+THRESHOLD=${THRESHOLD:-20}
+
+rm -rf "$WORK"
+mkdir -p "$WORK"
+WORK=$(cd "$WORK" && pwd)
+"$GENCORPUS" "$WORK"
+GENCORPUS=$(cd "$(dirname "$GENCORPUS")" && pwd)/$(basename "$GENCORPUS")
+SEASHELL=$(cd "$(dirname "$SEASHELL")" && pwd)/$(basename "$SEASHELL")
+
+size() {
+	wc -c < "$WORK/$1" | tr -d ' '
+}
+
+# scenario <name> <command name in stats> <bytes processed per run> <runs> <command> [setup]
+# setup is run before every run of command, e.g. to restore an input file
+# or to evict it from the page cache; ENV is passed to seashell
+scenario() {
+	name=$1 stat_name=$2 bytes=$3 runs=$4 cmd=$5 setup=$6 env=$7
+	script="$WORK/$name.cmd"
+	: > "$script"
+	i=0
+	while [ $i -lt "$runs" ]; do
+		[ -n "$setup" ] && echo "$setup" >> "$script"
+		echo "$cmd" >> "$script"
+		i=$((i + 1))
+	done
+	echo "stats -j $WORK/$name.json" >> "$script"
+	(cd "$WORK" && env HOME="$WORK" $env "$SEASHELL" < "$script" > "$WORK/$name.out" 2>&1)
+	# a command that could not run would make the scenario measure nothing
+	if grep -q "^-seashell: " "$WORK/$name.out"; then
+		echo "$name: $(grep -m 1 "^-seashell: " "$WORK/$name.out")" >&2
+		exit 1
+	fi
+
+	line=$(grep "\"name\": \"$stat_name\"" "$WORK/$name.json")
+	set -- $(echo "$line" | sed 's/.*"mean": \([0-9.]*\), "p50": \([0-9.]*\), "p90": \([0-9.]*\), "p99": \([0-9.]*\), "max": \([0-9.]*\).*/\1 \2 \3 \4 \5/')
+	if [ $bytes -gt 0 ]; then
+		unit=mb_per_s
+		throughput=$(awk -v b="$bytes" -v ms="$1" 'BEGIN { printf "%.2f", b / 1048576 / (ms / 1000) }')
+	else
+		unit=runs_per_s
+		throughput=$(awk -v ms="$1" 'BEGIN { printf "%.1f", 1000 / ms }')
+	fi
+	echo "  {\"name\": \"$name\", \"runs\": $runs, \"mean_ms\": $1, \"p50_ms\": $2, \"p90_ms\": $3, \"p99_ms\": $4, \"max_ms\": $5, \"$unit\": $throughput}" >> "$RESULTS.tmp"
+	printf '%-18s p50 %9.3fms  p90 %9.3fms  p99 %9.3fms  %10s %s\n' "$name" "$2" "$3" "$4" "$throughput" "$unit"
+}
+
+: > "$RESULTS.tmp"
+scenario highlight highlight "$(size log.txt)" "$RUNS" "highlight error r log.txt"
+scenario unique-l unique "$(size words.txt)" "$RUNS" "unique -l in.txt" "cp words.txt in.txt"
+scenario unique-f unique "$(size words.txt)" "$RUNS" "unique -f in.txt" "cp words.txt in.txt"
+scenario unique-i unique "$(size words.txt)" "$RUNS" "unique -i -f in.txt" "cp words.txt in.txt"
+scenario kdiff-a kdiff "$(($(size pair_a.txt) + $(size pair_b.txt)))" "$RUNS" "kdiff -a pair_a.txt pair_b.txt"
+scenario kdiff-b kdiff "$(($(size image_a.txt) + $(size image_b.txt)))" "$RUNS" "kdiff -b image_a.txt image_b.txt"
+# cold cache: the inputs are evicted before every run, once through io_uring
+# and once through the pread thread pool
+evict_images="$GENCORPUS -e image_a.txt image_b.txt"
+scenario kdiff-b-cold kdiff "$(($(size image_a.txt) + $(size image_b.txt)))" "$RUNS" "kdiff -b image_a.txt image_b.txt" "$evict_images"
+scenario kdiff-b-cold-pool kdiff "$(($(size image_a.txt) + $(size image_b.txt)))" "$RUNS" "kdiff -b image_a.txt image_b.txt" "$evict_images" SEASHELL_NO_IO_URING=1
+if command -v gzip > /dev/null; then
+	gzip -k "$WORK/log.txt" "$WORK/pair_a.txt" "$WORK/pair_b.txt"
+	scenario highlight-gz highlight "$(size log.txt)" "$RUNS" "highlight error r log.txt.gz"
+	scenario kdiff-a-gz kdiff "$(($(size pair_a.txt) + $(size pair_b.txt)))" "$RUNS" "kdiff -a pair_a.txt.gz pair_b.txt.gz"
+fi
+scenario shortdir-jump shortdir "$(size shortdir.txt)" "$RUNS" "shortdir jump sd9999"
+scenario spawn true 0 "$SPAWN_RUNS" "true"
+
+# join the scenario lines into one JSON document
+{
+	echo '{"scenarios": ['
+	sed '$!s/$/,/' "$RESULTS.tmp"
+	echo ']}'
+} > "$RESULTS"
+rm -f "$RESULTS.tmp"
+echo "results written to $RESULTS"
+
+if [ -z "$BASELINE" ] || [ ! -f "$BASELINE" ]; then
+	exit 0
+fi
+
+# compare the p50 of every scenario with the baseline
+awk -v threshold="$THRESHOLD" '
+	function field(line, key) {
+		if (!match(line, "\"" key "\": [0-9.]+")) return ""
+		return substr(line, RSTART + length(key) + 4, RLENGTH - length(key) - 4)
+	}
+	/"name"/ {
+		match($0, /"name": "[^"]*"/)
+		name = substr($0, RSTART + 9, RLENGTH - 10)
+		if (FILENAME == ARGV[1]) { base[name] = field($0, "p50_ms"); next }
+		p50 = field($0, "p50_ms")
+		if (!(name in base)) { printf "%-18s no baseline\n", name; next }
+		change = (p50 - base[name]) / base[name] * 100
+		status = change > threshold ? "REGRESSION" : "ok"
+		if (change > threshold) failed = 1
+		printf "%-18s p50 %9.3fms  baseline %9.3fms  %+7.1f%%  %s\n", name, p50, base[name], change, status
+	}
+	END { exit failed }
+' "$BASELINE" "$RESULTS"
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Generates the corpus used by bench.sh. The output only depends on the
+ * fixed seed, so every run and every machine benchmarks the same bytes.
+ *
+ * usage: gencorpus <dir>
+ *        gencorpus -e <file>...   drop the files from the page cache
+ */
+
+#define LOG_LINES 20000
+#define UNIQUE_LINES 2000
+#define PAIR_LINES 20000
+#define IMAGE_SIZE (4 * 1024 * 1024)
+#define SHORTDIR_ENTRIES 10000
+
+static uint32_t state = 2463534242u;
+
+/**
+ * xorshift32, fixed here instead of rand() so the corpus is the same with
+ * every libc
+ */
+uint32_t next_random(){
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+const char *words[] = {
+	"error", "Error", "ERROR", "warning", "info", "debug", "request", "response",
+	"timeout", "connection", "refused", "server", "client", "user", "session", "token",
+	"disk", "memory", "cpu", "latency", "retry", "failed", "succeeded", "started",
+	"stopped", "deploy", "rollback", "database", "query", "cache", "miss", "hit",
+	"kernel", "network", "packet", "dropped", "queue", "worker", "thread", "lock",
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+FILE *open_output(const char *dir, const char *name){
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *file = fopen(path, "w");
+	if(file == NULL){
+		perror(path);
+		exit(1);
+	}
+	return file;
+}
+
+/**
+ * A log line of 4 to 19 words with some punctuation
+ */
+void write_line(FILE *file, int line){
+	int count = 4 + next_random() % 16;
+	fprintf(file, "%06d", line);
+	for(int i = 0; i < count; i++){
+		const char *sep = (next_random() % 8 == 0) ? ", " : " ";
+		fprintf(file, "%s%s", sep, words[next_random() % WORD_COUNT]);
+	}
+	fprintf(file, ".\n");
+}
+
+/**
+ * Writes back and evicts the cached pages of a file, so the next read of it
+ * has to go to the disk. Used by the cold cache scenarios.
+ */
+static int evict(char *path){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		perror(path);
+		return 1;
+	}
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	if(argc > 2 && strcmp(argv[1], "-e") == 0){
+		int failed = 0;
+		for(int i = 2; i < argc; i++)
+			failed |= evict(argv[i]);
+		return failed;
+	}
+	if(argc != 2){
+		fprintf(stderr, "usage: %s <dir>\n       %s -e <file>...\n", argv[0], argv[0]);
+		return 1;
+	}
+	char *dir = argv[1];
+
+	// text log for highlight
+	FILE *file = open_output(dir, "log.txt");
+	for(int i = 0; i < LOG_LINES; i++)
+		write_line(file, i);
+	fclose(file);
+
+	// words only, without line numbers, so unique finds duplicates
+	file = open_output(dir, "words.txt");
+	for(int i = 0; i < UNIQUE_LINES; i++){
+		int count = 4 + next_random() % 12;
+		for(int j = 0; j < count; j++)
+			fprintf(file, "%s%s", j ? " " : "", words[next_random() % WORD_COUNT]);
+		fprintf(file, "\n");
+	}
+	fclose(file);
+
+	// near-identical text pair for kdiff -a, one line in 100 differs
+	FILE *file_a = open_output(dir, "pair_a.txt");
+	FILE *file_b = open_output(dir, "pair_b.txt");
+	for(int i = 0; i < PAIR_LINES; i++){
+		uint32_t saved = state;
+		write_line(file_a, i);
+		if(i % 100 == 99)
+			write_line(file_b, i);
+		else {
+			state = saved; // replay the same line
+			write_line(file_b, i);
+		}
+	}
+	fclose(file_a);
+	fclose(file_b);
+
+	// binary pair for kdiff -b, kdiff only accepts .txt names
+	file_a = open_output(dir, "image_a.txt");
+	file_b = open_output(dir, "image_b.txt");
+	for(int i = 0; i < IMAGE_SIZE; i += 4){
+		uint32_t value = next_random();
+		fwrite(&value, 4, 1, file_a);
+		if(i % 4096 == 0)
+			value ^= 0xff;
+		fwrite(&value, 4, 1, file_b);
+	}
+	fclose(file_a);
+	fclose(file_b);
+
+	// shortdir store, the bench jumps to the last entry
+	file = open_output(dir, "shortdir.txt");
+	for(int i = 0; i < SHORTDIR_ENTRIES; i++)
+		fprintf(file, "%s sd%d\n", dir, i);
+	fclose(file);
+
+	return 0;
+}
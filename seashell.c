@@ -1,5 +1,7 @@
+#define _GNU_SOURCE // asprintf, struct dirent64
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>            //termios, TCSANOW, ECHO, ICANON
@@ -7,12 +9,52 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 const char * sysname = "seashell";
+const char * builtin_names[] = { "cd", "exit", "highlight", "goodMorning", "kdiff", "shortdir", "unique", "stats", NULL };
 
 int shortdir_del(char *short_name, char *file_name, int MAX_LINE_LENGTH);
 int kdiff(int mod, char *file1_name, char *file2_name);
-char *toLower(char *tok);
-int isDuplicate(char *word);
+int kdiff_tree(char *dir1_name, char *dir2_name, bool content);
+FILE *input_open(char *file_name, char *mode, bool *compressed);
+size_t case_fold(char *dst, const char *src, size_t len);
+size_t class_span(const char *s, size_t len, unsigned char classes);
+size_t class_cspan(const char *s, size_t len, unsigned char classes);
+struct word_set;
+struct word_set *word_set_new();
+void word_set_clear(struct word_set *set);
+void word_set_free(struct word_set *set);
+bool word_set_add(struct word_set *set, const char *word, size_t length);
+int scheduler_add(int hour, int minute, char *music_file);
+int scheduler_list();
+int scheduler_cancel(int id);
+void scheduler_notify();
+
+enum char_classes {
+	CHAR_BLANK = 1, // separates the words of unique
+	CHAR_PUNCT = 2, // also separates the words of highlight
+};
 
 enum return_codes {
 	SUCCESS = 0,
@@ -28,6 +70,10 @@ struct command_t {
 	char *redirects[3]; // in/out redirection
 	struct command_t *next; // for piping
 };
+double now_ms();
+void stats_record(struct command_t *command, double wall_ms, double spawn_ms, struct rusage *usage);
+int stats_command(struct command_t *command);
+extern double last_parse_ms;
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -77,16 +123,139 @@ int free_command(struct command_t *command)
 	free(command);
 	return 0;
 }
+/**
+ * Terminal state shared by the line editor. The original termios settings
+ * are read once at startup; the prompt only switches between the two.
+ */
+static struct termios backup_termios, raw_termios;
+static bool interactive;
+static pid_t shell_pid; // forked builtins inherit the atexit handler
+static char hostname[256];
+static char cwd[1024];
+
+/**
+ * Output of the line editor is collected here and written with a single
+ * write() per keystroke instead of a putchar per character.
+ */
+static struct {
+	char data[16384];
+	int len;
+} term_out;
+
+void term_flush()
+{
+	int off=0;
+	while (off<term_out.len)
+	{
+		ssize_t n=write(STDOUT_FILENO, term_out.data+off, term_out.len-off);
+		if (n<=0 && errno!=EINTR) break;
+		if (n>0) off+=n;
+	}
+	term_out.len=0;
+}
+void term_write(const char *s, int n)
+{
+	if (!interactive) return; // nothing is echoed when reading from a pipe/file
+	while (n>0)
+	{
+		if (term_out.len==sizeof(term_out.data))
+			term_flush();
+		int chunk=sizeof(term_out.data)-term_out.len;
+		if (chunk>n) chunk=n;
+		memcpy(term_out.data+term_out.len, s, chunk);
+		term_out.len+=chunk;
+		s+=chunk;
+		n-=chunk;
+	}
+}
+/**
+ * Read one byte of input. stdin is read with read() into a buffer of our
+ * own rather than with getchar(): a child that exit()s through stdio would
+ * otherwise seek a script file shared with the shell back to what the
+ * shell had buffered, and the shell would run those lines again.
+ */
+static struct {
+	char data[4096];
+	int len;
+	int pos;
+} term_in;
+
+int term_getchar()
+{
+	if (term_in.pos==term_in.len)
+	{
+		ssize_t n;
+		do
+			n=read(STDIN_FILENO, term_in.data, sizeof(term_in.data));
+		while (n==-1 && errno==EINTR);
+		if (n<=0) return EOF;
+		term_in.len=n;
+		term_in.pos=0;
+	}
+	return (unsigned char)term_in.data[term_in.pos++];
+}
+void term_cursor_left(int n)
+{
+	char seq[16];
+	if (n>0)
+		term_write(seq, snprintf(seq, sizeof(seq), "\033[%dD", n));
+}
+void term_raw()
+{
+	if (interactive)
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+}
+void term_restore()
+{
+	// a builtin that exit()s, e.g. one run with &, must not put the tty
+	// back to cooked mode under the prompt
+	if (interactive && getpid()==shell_pid)
+		tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+}
+/**
+ * Refresh the cached working directory, called after cd and shortdir jump
+ */
+void update_cwd()
+{
+	if (getcwd(cwd, sizeof(cwd))==NULL)
+		strcpy(cwd, "?");
+}
+/**
+ * Read the terminal settings and the prompt information once at startup
+ */
+void term_init()
+{
+	interactive=isatty(STDIN_FILENO);
+	shell_pid=getpid();
+	if (interactive)
+	{
+		// tcgetattr gets the parameters of the current terminal
+		// STDIN_FILENO will tell tcgetattr that it should write the settings
+		// of stdin to backup_termios
+		tcgetattr(STDIN_FILENO, &backup_termios);
+		raw_termios = backup_termios;
+		// ICANON normally takes care that one line at a time will be processed
+		// that means it will return if it sees a "\n" or an EOF or an EOL
+		raw_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
+		raw_termios.c_cc[VMIN]=1;
+		raw_termios.c_cc[VTIME]=0;
+		atexit(term_restore);
+	}
+	if (gethostname(hostname, sizeof(hostname))!=0)
+		strcpy(hostname, "localhost");
+	hostname[sizeof(hostname)-1]=0;
+	update_cwd();
+}
 /**
  * Show the command prompt
  * @return [description]
  */
 int show_prompt()
 {
-	char cwd[1024], hostname[1024];
-    gethostname(hostname, sizeof(hostname));
-	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	char line[2048];
+	int n=snprintf(line, sizeof(line), "%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	if (n>=(int)sizeof(line)) n=sizeof(line)-1;
+	term_write(line, n);
 	return 0;
 }
 /**
@@ -197,171 +366,937 @@ int parse_command(char *buf, struct command_t *command)
 	command->arg_count=arg_index;
 	return 0;
 }
-void prompt_backspace()
+/**
+ * Command history: a ring buffer of the last HISTORY_SIZE lines, mirrored
+ * in an append-only file so that several sessions can share it. Entries are
+ * numbered by a sequence number that keeps growing; an entry lives in slot
+ * seq%HISTORY_SIZE until it is overwritten.
+ */
+#define HISTORY_SIZE 100000
+#define TRIGRAM_BUCKETS 65536
+static struct {
+	char *entries[HISTORY_SIZE];
+	long count; // sequence number of the next entry
+	int fd; // append-only history file, -1 if unavailable
+	off_t offset; // how much of the file has been read into the ring
+} history = { .fd=-1 };
+
+/**
+ * Trigram index for reverse search. Each bucket keeps the sequence numbers
+ * of the entries containing a trigram that hashes to it, in ascending order.
+ * Hash collisions only cost a few extra strstr calls since every candidate
+ * is verified.
+ */
+static struct posting {
+	long *seqs;
+	int len;
+	int cap;
+} trigram_index[TRIGRAM_BUCKETS];
+
+unsigned trigram_hash(const char *s)
+{
+	unsigned v=((unsigned char)s[0]<<16) | ((unsigned char)s[1]<<8) | (unsigned char)s[2];
+	return (v*2654435761u)>>16 & (TRIGRAM_BUCKETS-1);
+}
+long history_oldest()
 {
-	putchar(8); // go back 1
-	putchar(' '); // write empty over
-	putchar(8); // go back 1 again
+	return history.count>HISTORY_SIZE?history.count-HISTORY_SIZE:0;
 }
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Index of the first posting that is >= seq
+ * @param  p   bucket
+ * @param  seq sequence number
+ * @return     position in p->seqs
  */
-int prompt(struct command_t *command)
+int posting_lower_bound(struct posting *p, long seq)
 {
-	int index=0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
-
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-
-    //FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state=0;
-	buf[0]=0;
-  	while (1)
-  	{
-		c=getchar();
-		//printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-		if (c==9) // handle tab
+	int lo=0, hi=p->len;
+	while (lo<hi)
+	{
+		int mid=(lo+hi)/2;
+		if (p->seqs[mid]<seq) lo=mid+1;
+		else hi=mid;
+	}
+	return lo;
+}
+void posting_add(struct posting *p, long seq)
+{
+	if (p->len>0 && p->seqs[p->len-1]==seq) return; // trigram repeated in the same entry
+	if (p->len==p->cap)
+	{
+		// drop the postings of entries that fell out of the ring before growing
+		int stale=posting_lower_bound(p, history_oldest());
+		if (stale>0)
 		{
-			buf[index++]='?'; // autocomplete
-			break;
+			memmove(p->seqs, p->seqs+stale, sizeof(long)*(p->len-stale));
+			p->len-=stale;
 		}
-
-		if (c==127) // handle backspace
+		if (p->len==p->cap)
 		{
-			if (index>0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			continue;
+			p->cap=p->cap?p->cap*2:8;
+			p->seqs=realloc(p->seqs, sizeof(long)*p->cap);
 		}
-		if (c==27 && multicode_state==0) // handle multi-code keys
+	}
+	p->seqs[p->len++]=seq;
+}
+/**
+ * Add a line to the in-memory ring and the trigram index
+ */
+void history_push(const char *line, int len)
+{
+	long seq=history.count++;
+	char **slot=&history.entries[seq%HISTORY_SIZE];
+	free(*slot);
+	*slot=strndup(line, len);
+	for (int i=0;i+3<=len;++i)
+		posting_add(&trigram_index[trigram_hash(line+i)], seq);
+}
+const char *history_get(long seq)
+{
+	if (seq<history_oldest() || seq>=history.count) return NULL;
+	return history.entries[seq%HISTORY_SIZE];
+}
+/**
+ * Read the lines appended to the history file since the last call, by this
+ * session or any other one. Only complete lines are consumed.
+ */
+void history_sync()
+{
+	struct stat st;
+	char chunk[65536], *pending=NULL;
+	int pending_len=0;
+
+	if (history.fd==-1 || fstat(history.fd, &st)==-1) return;
+	if (st.st_size<history.offset) // the file was truncated by someone else
+		history.offset=st.st_size;
+	off_t off=history.offset;
+	while (off<st.st_size)
+	{
+		ssize_t n=pread(history.fd, chunk, sizeof(chunk), off);
+		if (n<=0) break;
+		off+=n;
+		int start=0;
+		for (int i=0;i<n;++i)
 		{
-			multicode_state=1;
-			continue;
+			if (chunk[i]!='\n') continue;
+			if (pending_len>0)
+			{
+				pending=realloc(pending, pending_len+i-start);
+				memcpy(pending+pending_len, chunk+start, i-start);
+				history_push(pending, pending_len+i-start);
+				pending_len=0;
+			}
+			else if (i>start)
+				history_push(chunk+start, i-start);
+			history.offset=off-n+i+1;
+			start=i+1;
 		}
-		if (c==91 && multicode_state==1)
+		if (start<n) // line continues in the next chunk
 		{
-			multicode_state=2;
-			continue;
+			pending=realloc(pending, pending_len+n-start);
+			memcpy(pending+pending_len, chunk+start, n-start);
+			pending_len+=n-start;
 		}
-		if (c==65 && multicode_state==2) // up arrow
+	}
+	free(pending);
+}
+/**
+ * Open ~/.seashell_history and load it into the ring
+ */
+void history_init()
+{
+	char *home_path=getenv("HOME");
+	char file_name[1024];
+	if (home_path==NULL) return;
+	snprintf(file_name, sizeof(file_name), "%s/.seashell_history", home_path);
+	history.fd=open(file_name, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	history_sync();
+}
+/**
+ * Record a command. The line is appended to the file with a single write,
+ * which keeps lines from concurrent sessions from interleaving, and then
+ * read back together with whatever other sessions appended meanwhile.
+ */
+void history_add(const char *line)
+{
+	int len=strlen(line);
+	const char *last=history_get(history.count-1);
+	if (len==0 || (last && strcmp(last, line)==0)) return;
+	if (history.fd!=-1)
+	{
+		char buf[4097];
+		memcpy(buf, line, len);
+		buf[len]='\n';
+		if (write(history.fd, buf, len+1)==len+1)
 		{
-			int i;
-			while (index>0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			for (i=0;oldbuf[i];++i)
-			{
-				putchar(oldbuf[i]);
-				buf[i]=oldbuf[i];
-			}
-			index=i;
-			continue;
+			history_sync();
+			return;
 		}
-		else
-			multicode_state=0;
-
-		putchar(c); // echo the character
-		buf[index++]=c;
-		if (index>=sizeof(buf)-1) break;
-		if (c=='\n') // enter key
-			break;
-		if (c==4) // Ctrl+D
-			return EXIT;
-  	}
-  	if (index>0 && buf[index-1]=='\n') // trim newline from the end
-  		index--;
-  	buf[index++]=0; // null terminate string
-
-  	strcpy(oldbuf, buf);
-
-  	parse_command(buf, command);
+	}
+	history_push(line, len);
+}
+/**
+ * Find the newest entry before a sequence number that contains a string
+ * @param  query  string to look for
+ * @param  before only entries with a smaller sequence number are considered
+ * @return        sequence number of the match, -1 if none
+ */
+long history_search(const char *query, long before)
+{
+	int len=strlen(query);
+	long oldest=history_oldest();
+	if (before>history.count) before=history.count;
 
-  	//print_command(command); // DEBUG: uncomment for debugging
+	if (len<3) // too short for the index, scan the ring
+	{
+		for (long seq=before-1;seq>=oldest;--seq)
+			if (strstr(history.entries[seq%HISTORY_SIZE], query))
+				return seq;
+		return -1;
+	}
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-  	return SUCCESS;
+	// walk the rarest trigram's postings backwards and verify each candidate
+	struct posting *best=NULL;
+	for (int i=0;i+3<=len;++i)
+	{
+		struct posting *p=&trigram_index[trigram_hash(query+i)];
+		if (best==NULL || p->len<best->len)
+			best=p;
+	}
+	for (int i=posting_lower_bound(best, before)-1;i>=0;--i)
+	{
+		long seq=best->seqs[i];
+		if (seq<oldest) break;
+		if (strstr(history.entries[seq%HISTORY_SIZE], query))
+			return seq;
+	}
+	return -1;
 }
-int process_command(struct command_t *command);
-int main()
+/**
+ * Prefix trie used by tab completion. Children are kept in a sorted sibling
+ * list, which is compact enough for tens of thousands of names.
+ */
+struct trie_node {
+	char c;
+	bool terminal;
+	struct trie_node *child;
+	struct trie_node *sibling;
+};
+void trie_insert(struct trie_node *root, const char *s)
 {
-	while (1)
+	struct trie_node *node=root;
+	for (;*s;++s)
 	{
-		struct command_t *command=malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-		int code;
-		code = prompt(command);
-		if (code==EXIT) break;
+		struct trie_node **link=&node->child;
+		while (*link && (unsigned char)(*link)->c<(unsigned char)*s)
+			link=&(*link)->sibling;
+		if (*link==NULL || (*link)->c!=*s)
+		{
+			struct trie_node *n=calloc(1, sizeof(struct trie_node));
+			n->c=*s;
+			n->sibling=*link;
+			*link=n;
+		}
+		node=*link;
+	}
+	node->terminal=true;
+}
+struct trie_node *trie_find(struct trie_node *root, const char *s)
+{
+	struct trie_node *node=root;
+	for (;node && *s;++s)
+	{
+		node=node->child;
+		while (node && node->c!=*s)
+			node=node->sibling;
+	}
+	return node;
+}
+/**
+ * Release all nodes below a node
+ */
+void trie_clear(struct trie_node *node)
+{
+	struct trie_node *n=node->child, *next;
+	while (n)
+	{
+		trie_clear(n);
+		next=n->sibling;
+		free(n);
+		n=next;
+	}
+	node->child=NULL;
+	node->terminal=false;
+}
+/**
+ * Collect the names below a node
+ * @param  node  node of the prefix
+ * @param  buf   prefix so far, names are built in place
+ * @param  len   length of the prefix
+ * @param  out   first max names found are copied here
+ * @param  max   size of out
+ * @param  count number of names found so far
+ * @return       new count
+ */
+int trie_collect(struct trie_node *node, char *buf, int len, char **out, int max, int count)
+{
+	if (node->terminal)
+	{
+		if (count<max)
+		{
+			buf[len]=0;
+			out[count]=strdup(buf);
+		}
+		count++;
+	}
+	if (len>=4095) return count;
+	for (struct trie_node *n=node->child;n;n=n->sibling)
+	{
+		buf[len]=n->c;
+		count=trie_collect(n, buf, len+1, out, max, count);
+	}
+	return count;
+}
 
-		code = process_command(command);
-		if (code==EXIT) break;
+/**
+ * A trie built from some directories or files. It stays valid as long as
+ * the key it was built for is the same and none of its sources changed
+ * mtime, so completion does not rescan anything on each keystroke.
+ */
+#define MAX_CACHE_SOURCES 64
+struct trie_cache {
+	struct trie_node root;
+	bool built;
+	char key[4096];
+	int count;
+	struct timespec mtimes[MAX_CACHE_SOURCES];
+};
+static struct trie_cache command_cache, dir_cache, alias_cache;
 
-		free_command(command);
+/**
+ * Check a cache against its sources. When it is stale the trie is emptied
+ * and the new key and mtimes are recorded, the caller then refills it.
+ * @param  sources paths of the directories/files the trie is built from
+ * @return         true if the trie can be used as is
+ */
+bool trie_cache_check(struct trie_cache *cache, const char *key, char **sources, int count)
+{
+	struct timespec mtimes[MAX_CACHE_SOURCES];
+	struct stat st;
+	if (count>MAX_CACHE_SOURCES) count=MAX_CACHE_SOURCES;
+	for (int i=0;i<count;++i)
+	{
+		if (stat(sources[i], &st)==0)
+			mtimes[i]=st.st_mtim;
+		else
+			mtimes[i].tv_sec=mtimes[i].tv_nsec=0;
 	}
 
-	printf("\n");
-	return 0;
+	bool valid=cache->built && cache->count==count && strcmp(cache->key, key)==0;
+	for (int i=0;valid && i<count;++i)
+		valid=cache->mtimes[i].tv_sec==mtimes[i].tv_sec && cache->mtimes[i].tv_nsec==mtimes[i].tv_nsec;
+	if (valid) return true;
+
+	trie_clear(&cache->root);
+	cache->built=true;
+	snprintf(cache->key, sizeof(cache->key), "%s", key);
+	cache->count=count;
+	memcpy(cache->mtimes, mtimes, sizeof(struct timespec)*count);
+	return false;
 }
-
-int process_command(struct command_t *command)
+/**
+ * Trie of the builtins and every executable on PATH
+ */
+struct trie_node *command_trie()
 {
-	int r;
-	if (strcmp(command->name, "")==0) return SUCCESS;
-
-	if (strcmp(command->name, "exit")==0)
-		return EXIT;
-
-	if (strcmp(command->name, "cd")==0)
+	char *env_path=getenv("PATH");
+	char path_copy[4096], *sources[MAX_CACHE_SOURCES];
+	int count=0;
+
+	snprintf(path_copy, sizeof(path_copy), "%s", env_path?env_path:"");
+	for (char *tok=strtok(path_copy, ":");tok && count<MAX_CACHE_SOURCES;tok=strtok(NULL, ":"))
+		sources[count++]=tok;
+	if (trie_cache_check(&command_cache, env_path?env_path:"", sources, count))
+		return &command_cache.root;
+
+	for (int i=0;builtin_names[i];++i)
+		trie_insert(&command_cache.root, builtin_names[i]);
+	for (int i=0;i<count;++i)
 	{
-		if (command->arg_count > 0)
+		DIR *dir=opendir(sources[i]);
+		struct dirent *entry;
+		struct stat st;
+		if (dir==NULL) continue;
+		while ((entry=readdir(dir))!=NULL)
 		{
-			r=chdir(command->args[0]);
-			if (r==-1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			return SUCCESS;
+			if (entry->d_name[0]=='.' || entry->d_type==DT_DIR) continue;
+			if (fstatat(dirfd(dir), entry->d_name, &st, 0)==0
+				&& S_ISREG(st.st_mode) && (st.st_mode & 0111))
+				trie_insert(&command_cache.root, entry->d_name);
 		}
+		closedir(dir);
 	}
-
-	int pipe_buff[2];
-	if(pipe(pipe_buff) == -1){
-		printf("Pipe failed.");
-		exit(0);
+	return &command_cache.root;
+}
+/**
+ * Trie of the entries of a directory, directories get a trailing '/'
+ */
+struct trie_node *dir_trie(char *dir_name)
+{
+	// the key is absolute, directories in different places can share an mtime
+	char key[2048];
+	if (dir_name[0]=='/')
+		snprintf(key, sizeof(key), "%s", dir_name);
+	else
+		snprintf(key, sizeof(key), "%s/%s", cwd, dir_name);
+	if (trie_cache_check(&dir_cache, key, &dir_name, 1))
+		return &dir_cache.root;
+
+	DIR *dir=opendir(dir_name);
+	struct dirent *entry;
+	struct stat st;
+	char name[512];
+	if (dir==NULL) return &dir_cache.root;
+	while ((entry=readdir(dir))!=NULL)
+	{
+		if (strcmp(entry->d_name, ".")==0 || strcmp(entry->d_name, "..")==0) continue;
+		bool is_dir=entry->d_type==DT_DIR;
+		if (entry->d_type==DT_UNKNOWN || entry->d_type==DT_LNK)
+			is_dir=fstatat(dirfd(dir), entry->d_name, &st, 0)==0 && S_ISDIR(st.st_mode);
+		snprintf(name, sizeof(name), "%s%s", entry->d_name, is_dir?"/":"");
+		trie_insert(&dir_cache.root, name);
+	}
+	closedir(dir);
+	return &dir_cache.root;
+}
+/**
+ * Trie of the short names saved with shortdir set
+ */
+struct trie_node *alias_trie()
+{
+	char *home_path=getenv("HOME");
+	char file_name[1024], line[500];
+	char *source=file_name;
+	snprintf(file_name, sizeof(file_name), "%s/shortdir.txt", home_path?home_path:"");
+	if (trie_cache_check(&alias_cache, file_name, &source, 1))
+		return &alias_cache.root;
+
+	FILE *shdir_file=fopen(file_name, "r");
+	if (shdir_file==NULL) return &alias_cache.root;
+	while (fgets(line, sizeof(line), shdir_file))
+	{
+		strtok(line, " ");
+		char *sh=strtok(NULL, "\n");
+		if (sh) trie_insert(&alias_cache.root, sh);
+	}
+	fclose(shdir_file);
+	return &alias_cache.root;
+}
+/**
+ * The line being edited and the cursor position in it
+ */
+struct line_state {
+	char buf[4096];
+	int len;
+	int pos;
+};
+/**
+ * The line is kept as UTF-8 bytes while the terminal cursor moves by
+ * columns: the cursor steps over whole sequences, and continuation bytes
+ * take no column.
+ */
+bool utf8_continuation(char c)
+{
+	return ((unsigned char)c & 0xc0)==0x80;
+}
+int line_columns(struct line_state *ls, int from, int to)
+{
+	int columns=0;
+	for (int i=from;i<to;++i)
+		columns+=!utf8_continuation(ls->buf[i]);
+	return columns;
+}
+int line_prev(struct line_state *ls, int pos)
+{
+	if (pos<=0) return 0;
+	do
+		pos--;
+	while (pos>0 && utf8_continuation(ls->buf[pos]));
+	return pos;
+}
+int line_next(struct line_state *ls, int pos)
+{
+	if (pos>=ls->len) return ls->len;
+	do
+		pos++;
+	while (pos<ls->len && utf8_continuation(ls->buf[pos]));
+	return pos;
+}
+/**
+ * Insert a byte at the cursor and redraw the rest of the line. The bytes
+ * of a multi-byte character are drawn together once the last one arrives.
+ */
+void line_insert(struct line_state *ls, char c)
+{
+	if (ls->len>=(int)sizeof(ls->buf)-1) return;
+	memmove(ls->buf+ls->pos+1, ls->buf+ls->pos, ls->len-ls->pos);
+	ls->buf[ls->pos]=c;
+	ls->len++;
+	ls->pos++;
+
+	int start=ls->pos-1;
+	while (start>0 && utf8_continuation(ls->buf[start]))
+		start--;
+	unsigned char lead=ls->buf[start];
+	int need=lead>=0xf0?4:lead>=0xe0?3:lead>=0xc0?2:1;
+	if (ls->pos-start<need) return;
+
+	term_write(ls->buf+start, ls->len-start);
+	term_cursor_left(line_columns(ls, ls->pos, ls->len));
+}
+/**
+ * Delete the character under the cursor and redraw the rest of the line
+ */
+void line_delete(struct line_state *ls)
+{
+	if (ls->pos>=ls->len) return;
+	int n=line_next(ls, ls->pos)-ls->pos;
+	memmove(ls->buf+ls->pos, ls->buf+ls->pos+n, ls->len-ls->pos-n);
+	ls->len-=n;
+	term_write(ls->buf+ls->pos, ls->len-ls->pos);
+	term_write("\033[K", 3); // clear what is left of the old line
+	term_cursor_left(line_columns(ls, ls->pos, ls->len));
+}
+void line_backspace(struct line_state *ls)
+{
+	if (ls->pos==0) return;
+	ls->pos=line_prev(ls, ls->pos);
+	term_write("\b", 1);
+	line_delete(ls);
+}
+void line_move(struct line_state *ls, int pos)
+{
+	if (pos<0) pos=0;
+	if (pos>ls->len) pos=ls->len;
+	if (pos<ls->pos)
+		term_cursor_left(line_columns(ls, pos, ls->pos));
+	else
+		term_write(ls->buf+ls->pos, pos-ls->pos); // rewriting moves the cursor right
+	ls->pos=pos;
+}
+/**
+ * Replace the whole line, e.g. with a line from history
+ */
+void line_replace(struct line_state *ls, const char *s)
+{
+	term_cursor_left(line_columns(ls, 0, ls->pos));
+	ls->len=strlen(s);
+	if (ls->len>=(int)sizeof(ls->buf))
+		ls->len=sizeof(ls->buf)-1;
+	memcpy(ls->buf, s, ls->len);
+	ls->buf[ls->len]=0;
+	ls->pos=ls->len;
+	term_write(ls->buf, ls->len);
+	term_write("\033[K", 3);
+}
+/**
+ * Redraw the prompt and the whole line after something else was shown
+ */
+void line_refresh(struct line_state *ls)
+{
+	term_write("\r\033[K", 4);
+	show_prompt();
+	term_write(ls->buf, ls->len);
+	term_cursor_left(line_columns(ls, ls->pos, ls->len));
+}
+/**
+ * Complete the word before the cursor. The first word of a command is
+ * looked up among builtins and PATH, the short name after shortdir jump/del
+ * among the saved shortdirs and anything else among file names. A unique
+ * match is completed, otherwise the common prefix is added, and if there is
+ * none the candidates are listed.
+ */
+#define MAX_LISTED_COMPLETIONS 100
+void line_complete(struct line_state *ls)
+{
+	int start=ls->pos;
+	while (start>0 && ls->buf[start-1]!=' ' && ls->buf[start-1]!='\t')
+		start--;
+	char word[4096], before[4096], *words[2];
+	int nwords=0;
+	memcpy(word, ls->buf+start, ls->pos-start);
+	word[ls->pos-start]=0;
+	memcpy(before, ls->buf, start);
+	before[start]=0;
+	for (char *tok=strtok(before, " \t");tok;tok=strtok(NULL, " \t"))
+	{
+		if (strcmp(tok, "|")==0)
+			nwords=0; // the next word is a command again
+		else
+		{
+			if (nwords<2) words[nwords]=tok;
+			nwords++;
+		}
 	}
 
-	pid_t pid=fork();
-	if (pid==0) // child
+	struct trie_node *root;
+	char *prefix=word, dir_name[4096];
+	bool skip_hidden=false;
+	if (nwords==0 && strchr(word, '/')==NULL)
+		root=command_trie();
+	else if (nwords==2 && strcmp(words[0], "shortdir")==0
+		&& (strcmp(words[1], "jump")==0 || strcmp(words[1], "del")==0))
+		root=alias_trie();
+	else
 	{
-		/// This shows how to do exec with environ (but is not available on MacOs)
-	    // extern char** environ; // environment variables
-		// execvpe(command->name, command->args, environ); // exec+args+path+environ
+		char *slash=strrchr(word, '/');
+		if (slash==NULL)
+			strcpy(dir_name, ".");
+		else if (word[0]=='~' && word[1]=='/' && getenv("HOME"))
+			snprintf(dir_name, sizeof(dir_name), "%s%.*s", getenv("HOME"), (int)(slash-word), word+1);
+		else
+			snprintf(dir_name, sizeof(dir_name), "%.*s", (int)(slash-word+1), word);
+		prefix=slash?slash+1:word;
+		skip_hidden=prefix[0]!='.';
+		root=dir_trie(dir_name);
+	}
 
-		/// This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
+	struct trie_node *node=trie_find(root, prefix);
+	char name[4096], *found[MAX_LISTED_COMPLETIONS];
+	int plen=strlen(prefix), count=0;
+	if (node)
+	{
+		strcpy(name, prefix);
+		if (skip_hidden && plen==0)
+		{
+			for (struct trie_node *n=node->child;n;n=n->sibling)
+				if (n->c!='.')
+				{
+					name[0]=n->c;
+					count=trie_collect(n, name, 1, found, MAX_LISTED_COMPLETIONS, count);
+				}
+		}
+		else
+			count=trie_collect(node, name, plen, found, MAX_LISTED_COMPLETIONS, count);
+	}
+
+	if (count==0)
+		term_write("\a", 1);
+	else if (count==1)
+	{
+		for (char *s=found[0]+plen;*s;++s)
+			line_insert(ls, *s);
+		if (found[0][strlen(found[0])-1]!='/')
+			line_insert(ls, ' ');
+	}
+	else
+	{
+		// extend to the prefix shared by all candidates
+		int added=0;
+		while (plen>0 && !node->terminal && node->child && node->child->sibling==NULL)
+		{
+			node=node->child;
+			line_insert(ls, node->c);
+			added++;
+		}
+		if (added==0)
+		{
+			term_write("\n", 1);
+			for (int i=0;i<count && i<MAX_LISTED_COMPLETIONS;++i)
+			{
+				term_write(found[i], strlen(found[i]));
+				term_write("  ", 2);
+			}
+			if (count>MAX_LISTED_COMPLETIONS)
+			{
+				char more[64];
+				term_write(more, snprintf(more, sizeof(more), "... and %d more", count-MAX_LISTED_COMPLETIONS));
+			}
+			term_write("\n", 1);
+			line_refresh(ls);
+		}
+	}
+	for (int i=0;i<count && i<MAX_LISTED_COMPLETIONS;++i)
+		free(found[i]);
+}
+/**
+ * State of a Ctrl+R reverse incremental search
+ */
+struct search_state {
+	bool active;
+	bool failed;
+	char query[256];
+	int len;
+	long match; // sequence number of the current match, -1 if none yet
+};
+void search_refresh(struct search_state *ss)
+{
+	char line[4500];
+	const char *match=ss->match>=0?history_get(ss->match):"";
+	int n=snprintf(line, sizeof(line), "\r\033[K(%sreverse-i-search)`%s': %s",
+		ss->failed?"failed ":"", ss->query, match?match:"");
+	if (n>=(int)sizeof(line)) n=sizeof(line)-1;
+	term_write(line, n);
+}
+/**
+ * Search again for the query, starting below a sequence number
+ */
+void search_update(struct search_state *ss, long before)
+{
+	long seq=history_search(ss->query, before);
+	ss->failed=(seq==-1);
+	if (seq!=-1)
+		ss->match=seq;
+	search_refresh(ss);
+}
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct command_t *command)
+{
+	int c;
+	struct line_state ls;
+	struct search_state search={ .active=false };
+	char saved[4096]; // the line being typed while browsing history
+	saved[0]=0;
+
+	fflush(stdout); // anything printed with stdio must appear before the prompt
+	term_raw();
+	history_sync(); // pick up commands other sessions ran meanwhile
+	show_prompt();
+	term_flush();
+
+	int multicode_state=0;
+	long hist_pos=history.count; // entry shown by up/down, history.count for a new line
+	ls.len=ls.pos=0;
+	while (1)
+	{
+		c=term_getchar();
+		//printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+		if (c==EOF || (c==4 && interactive)) // Ctrl+D or end of input
+		{
+			term_flush();
+			term_restore();
+			return EXIT;
+		}
+
+		if (search.active)
+		{
+			if (c>=32 && c!=127)
+			{
+				if (search.len<(int)sizeof(search.query)-1)
+				{
+					search.query[search.len++]=c;
+					search.query[search.len]=0;
+				}
+				// the current match may still contain the longer query
+				search_update(&search, search.match>=0?search.match+1:history.count);
+			}
+			else if (c==127 || c==8)
+			{
+				if (search.len>0)
+					search.query[--search.len]=0;
+				search.match=-1;
+				search_update(&search, history.count);
+			}
+			else if (c==18) // Ctrl+R again, look for an older match
+				search_update(&search, search.match>=0?search.match:history.count);
+			else if (c==7) // Ctrl+G, give up and restore the line
+			{
+				search.active=false;
+				line_refresh(&ls);
+			}
+			else // any other key takes the match and is then handled as usual
+			{
+				search.active=false;
+				if (search.match>=0)
+				{
+					ls.len=ls.pos=0;
+					line_replace(&ls, history_get(search.match));
+					hist_pos=search.match;
+				}
+				line_refresh(&ls);
+			}
+			if (search.active)
+			{
+				term_flush();
+				continue;
+			}
+		}
+
+		if (multicode_state==1)
+		{
+			multicode_state=(c=='[' || c=='O')?2:0;
+			continue;
+		}
+		if (multicode_state==3) // the '~' closing a numbered sequence
+		{
+			multicode_state=0;
+			continue;
+		}
+		if (multicode_state==2) // handle multi-code keys
+		{
+			multicode_state=0;
+			if (c=='A') // up arrow
+			{
+				const char *entry=history_get(hist_pos-1);
+				if (entry)
+				{
+					if (hist_pos==history.count)
+					{
+						ls.buf[ls.len]=0;
+						strcpy(saved, ls.buf);
+					}
+					hist_pos--;
+					line_replace(&ls, entry);
+				}
+			}
+			else if (c=='B') // down arrow
+			{
+				if (hist_pos<history.count)
+				{
+					hist_pos++;
+					line_replace(&ls, hist_pos==history.count?saved:history_get(hist_pos));
+				}
+			}
+			else if (c=='C') // right arrow
+				line_move(&ls, line_next(&ls, ls.pos));
+			else if (c=='D') // left arrow
+				line_move(&ls, line_prev(&ls, ls.pos));
+			else if (c=='H') // home
+				line_move(&ls, 0);
+			else if (c=='F') // end
+				line_move(&ls, ls.len);
+			else if (c=='3') // delete, sent as ESC [ 3 ~
+			{
+				line_delete(&ls);
+				multicode_state=3;
+			}
+			else if (c>='0' && c<='9')
+				multicode_state=3;
+			term_flush();
+			continue;
+		}
+
+		if (c==27)
+			multicode_state=1;
+		else if (c==9 && interactive) // handle tab
+			line_complete(&ls);
+		else if (c==127 || c==8) // handle backspace
+			line_backspace(&ls);
+		else if (c==1) // Ctrl+A
+			line_move(&ls, 0);
+		else if (c==5) // Ctrl+E
+			line_move(&ls, ls.len);
+		else if (c==18 && interactive) // Ctrl+R
+		{
+			// keep the new line, down arrow returns to it after a match is taken
+			if (hist_pos==history.count)
+			{
+				ls.buf[ls.len]=0;
+				strcpy(saved, ls.buf);
+			}
+			search.active=true;
+			search.failed=false;
+			search.query[0]=0;
+			search.len=0;
+			search.match=-1;
+			search_refresh(&search);
+		}
+		else if (c=='\n' || c=='\r') // enter key
+		{
+			line_move(&ls, ls.len);
+			term_write("\n", 1);
+			term_flush();
+			break;
+		}
+		else if (c>=32) // printable, UTF-8 bytes included
+			line_insert(&ls, c);
+		term_flush();
+	}
+	term_restore();
+	ls.buf[ls.len]=0; // null terminate string
+
+	history_add(ls.buf);
+
+	double parse_start=now_ms();
+	parse_command(ls.buf, command);
+	last_parse_ms=now_ms()-parse_start;
+
+	//print_command(command); // DEBUG: uncomment for debugging
+	return SUCCESS;
+}
+int process_command(struct command_t *command);
+int main()
+{
+	term_init();
+	if (interactive) // scripts piped into the shell are not recorded
+		history_init();
+	while (1)
+	{
+		struct command_t *command=malloc(sizeof(struct command_t));
+		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+
+		int code;
+		code = prompt(command);
+		if (code==EXIT) break;
+
+		code = process_command(command);
+		if (code==EXIT) break;
+
+		free_command(command);
+	}
+
+	printf("\n");
+	return 0;
+}
+
+int process_command(struct command_t *command)
+{
+	int r;
+	if (strcmp(command->name, "")==0) return SUCCESS;
+
+	if (strcmp(command->name, "exit")==0)
+		return EXIT;
+
+	if (strcmp(command->name, "cd")==0)
+	{
+		if (command->arg_count > 0)
+		{
+			r=chdir(command->args[0]);
+			if (r==-1)
+				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+			else
+				update_cwd();
+			return SUCCESS;
+		}
+	}
+
+	if (strcmp(command->name, "stats")==0)
+		return stats_command(command);
+
+	int pipe_buff[2];
+	if(pipe(pipe_buff) == -1){
+		printf("Pipe failed.");
+		exit(0);
+	}
+
+	double fork_start=now_ms();
+	pid_t pid=fork();
+	double spawn_ms=now_ms()-fork_start;
+	if (pid==0) // child
+	{
+		/// This shows how to do exec with environ (but is not available on MacOs)
+	    // extern char** environ; // environment variables
+		// execvpe(command->name, command->args, environ); // exec+args+path+environ
+
+		/// This shows how to do exec with auto-path resolve
+		// add a NULL argument to the end of args, and the name to the beginning
+		// as required by exec
 
 		// increase args size by 2
 		command->args=(char **)realloc(
@@ -379,78 +1314,86 @@ int process_command(struct command_t *command)
 		/** PART 3 **/
 		if (strcmp(command->name, "highlight") == 0){ //TODO NOKTALAMADAN SONRA \n GELİNCE NEW LINE YAPMIYO
 
-        	FILE *file;
-        	char *token;
-        	char *copy;
-			char *strippedline;
-        	char line[500];
-        	file = fopen(command->args[3], "r");
-        	
 			if(command->arg_count != 5){
-            	printf("Missing arguments. Try again.\n");
-            	exit(0);
-        	}
+				printf("Missing arguments. Try again.\n");
+				exit(0);
+			}
 
+			FILE *file = input_open(command->args[3], "r", NULL);
 			if(file == NULL){
 				printf("Cannot open file: %s\n", command->args[3]);
 				exit(0);
 			}
 
-			while(fgets(line, 500, file) != NULL){
-            	strippedline = strtok(line,"\n\r");
-            	copy=strdup(strippedline);
-            	token = strtok(strippedline, " :;.,\n\r\t");
-				while(token != NULL){
-
-					if(strcmp(toLower(token), toLower(command->args[1])) == 0){
-						if(strcmp("g", command->args[2])==0){
-							printf("\033[0;32m");
-						}else if(strcmp("b", command->args[2])==0){
-							printf("\033[0;34m");
-						}else{        // red if not specified
-							printf("\033[0;31m");
-						}
-						printf("%s\033[0m%c",token,copy[token-strippedline+strlen(token)]);
-
-					}else{
-						printf("%s%c",token,copy[token-strippedline+strlen(token)]);
-					}
-					token = strtok(NULL, " :;.,\n\r\t");
+			char *color = "\033[0;31m"; // red if not specified
+			if(strcmp("g", command->args[2]) == 0)
+				color = "\033[0;32m";
+			else if(strcmp("b", command->args[2]) == 0)
+				color = "\033[0;34m";
+
+			// the keyword is folded once, every token into a scratch buffer
+			char *key = command->args[1];
+			size_t key_length = case_fold(key, key, strlen(key));
+
+			char *line = NULL, *folded = NULL;
+			size_t capacity = 0;
+			ssize_t length = 0;
+			while((length = getline(&line, &capacity, file)) != -1){
+				folded = realloc(folded, capacity);
+				size_t i = 0;
+				while(i < (size_t)length){
+					// delimiters are printed as they are
+					size_t n = class_span(line + i, length - i, CHAR_BLANK | CHAR_PUNCT);
+					fwrite(line + i, 1, n, stdout);
+					i += n;
+
+					n = class_cspan(line + i, length - i, CHAR_BLANK | CHAR_PUNCT);
+					if(n >= key_length && case_fold(folded, line + i, n) == key_length
+							&& memcmp(folded, key, key_length) == 0)
+						printf("%s%.*s\033[0m", color, (int)n, line + i);
+					else
+						fwrite(line + i, 1, n, stdout);
+					i += n;
 				}
-				printf("\n");
+				if(line[length - 1] != '\n')
+					printf("\n");
 			}
+			if(ferror(file))
+				printf("Error reading the file: %s\n", command->args[3]);
+			free(line);
+			free(folded);
 			fclose(file);
-    		exit(0);
-    	}
+			exit(0);
+		}
 
 		/** PART 4 **/
 		if(strcmp(command->name, "goodMorning") == 0){
-			if(command->arg_count == 4){
+			if(command->arg_count == 3 && strcmp(command->args[1], "list") == 0){
+				scheduler_list();
+				exit(0);
+			} else if(command->arg_count == 4 && strcmp(command->args[1], "cancel") == 0){
+				scheduler_cancel(atoi(command->args[2]));
+				scheduler_notify();
+				exit(0);
+			} else if(command->arg_count == 4){
 				char *time_pattern = "[0-2][0-9].[0-5][0-9]";
 				if(fnmatch(time_pattern, command->args[1], 0) != 0){
 					printf("Invalid time\n");
 					exit(0);
 				}
 
-				char *home_path = getenv("HOME");
-				char file_name[150];
-				strcpy(file_name, home_path);
-				strcat(file_name, "/playmusic.txt");
-		
-				char *hour = strtok(command->args[1], ".");
-				char *minute = strtok(NULL, " ");
-				FILE *file = fopen(file_name, "w");
-		
-				fprintf(file, "%s %s", minute, hour);
-				fprintf(file, " * * * XDG_RUNTIME_DIR=/run/user/$(id -u) DISPLAY=:0.0 /usr/bin/rhythmbox-client --play ");
-				fprintf(file, "%s\n", command->args[2]);
-
-				fclose(file);
-
-				char cmd[200];
-				strcpy(cmd, "crontab ");
-				strcat(cmd, file_name);
-				system(cmd);
+				int hour = atoi(strtok(command->args[1], "."));
+				int minute = atoi(strtok(NULL, " "));
+				if(hour > 23){
+					printf("Invalid time\n");
+					exit(0);
+				}
+
+				int id = scheduler_add(hour, minute, command->args[2]);
+				if(id > 0){
+					scheduler_notify();
+					printf("Alarm %d set for %02d.%02d\n", id, hour, minute);
+				}
 				exit(0);
 			} else {
 				printf("Invalid arguments\n");
@@ -469,6 +1412,13 @@ int process_command(struct command_t *command)
 			} else if(command->arg_count == 5 && strcmp(command->args[1], "-b") == 0){
 				if(kdiff(1, command->args[2], command->args[3]) == SUCCESS)
 					exit(0);
+			} else if(command->arg_count == 5 && strcmp(command->args[1], "-r") == 0){
+				if(kdiff_tree(command->args[2], command->args[3], false) == SUCCESS)
+					exit(0);
+			} else if(command->arg_count == 6 && strcmp(command->args[1], "-r") == 0 && strcmp(command->args[2], "-c") == 0){
+				// content: also read files with the same size and mtime
+				if(kdiff_tree(command->args[3], command->args[4], true) == SUCCESS)
+					exit(0);
 			} else {
 				printf("Invalid arguments\n");
 				exit(0);
@@ -602,68 +1552,85 @@ int process_command(struct command_t *command)
 
 		/**PART 6**/
 		if(strcmp(command->name, "unique") == 0){
-			if(command->arg_count != 4){
+			// unique [-i] -l|-f file
+			bool fold = false;
+			char *mode = NULL;
+			int arg = 1;
+			for(; arg < command->arg_count - 2; arg++){
+				if(strcmp(command->args[arg], "-i") == 0)
+					fold = true;
+				else if(strcmp(command->args[arg], "-l") == 0 || strcmp(command->args[arg], "-f") == 0)
+					mode = command->args[arg];
+				else
+					break;
+			}
+			if(mode == NULL || arg != command->arg_count - 2 || command->arg_count > 5){
 				printf("Invalid arguments\n");
 				exit(0);
 			}
+			char *file_name = command->args[arg];
 
-			int MAX_LINE_LENGTH = 500;
-
-			if(strcmp(command->args[1], "-l") == 0 || strcmp(command->args[1], "-f") == 0){
-				FILE *file = fopen(command->args[2], "r");
-				FILE *temp = fopen("temp.txt", "w");
-				FILE *unique_words = fopen("unique.txt", "w");
-				fclose(unique_words);
-
-				char *token;
-				char line[MAX_LINE_LENGTH];
+			bool compressed;
+			FILE *file = input_open(file_name, "r", &compressed);
+			if(file == NULL){
+				printf("Error opening the file: %s\n", file_name);
+				exit(0);
+			}
 
-				if(file == NULL || temp == NULL || unique_words == NULL){
-					printf("Error opening the file: %s\n", command->args[2]);
-					exit(0);
-				}
-				
-				while(fgets(line, MAX_LINE_LENGTH, file) != NULL){
-					token = strtok(line, " \n");
-					while(token != NULL){
-						if(!isDuplicate(token)){
-							fprintf(temp, "%s ", token);
-							unique_words = fopen("unique.txt", "a");
-							fprintf(unique_words, "%s\n", token);
-							fclose(unique_words);
-						}
-						
-						token = strtok(NULL, " \n");
-					}
-					fprintf(temp, "\n");
-					if(strcmp(command->args[1], "-l") == 0){
-						unique_words = fopen("unique.txt", "w");
-						fclose(unique_words);
+			// the result is kept in memory until the input is closed, then
+			// written over it
+			char *result;
+			size_t result_size;
+			FILE *out = open_memstream(&result, &result_size);
+			struct word_set *seen = word_set_new();
+
+			char *line = NULL, *folded = NULL;
+			size_t capacity = 0;
+			ssize_t length = 0;
+			while((length = getline(&line, &capacity, file)) != -1){
+				if(fold)
+					folded = realloc(folded, capacity);
+				size_t i = class_span(line, length, CHAR_BLANK);
+				while(i < (size_t)length){
+					size_t n = class_cspan(line + i, length - i, CHAR_BLANK);
+					// with -i the first spelling of a word is kept
+					char *key = line + i;
+					size_t key_length = n;
+					if(fold){
+						key = folded;
+						key_length = case_fold(folded, line + i, n);
 					}
+					if(word_set_add(seen, key, key_length))
+						fprintf(out, "%.*s ", (int)n, line + i);
+					i += n;
+					i += class_span(line + i, length - i, CHAR_BLANK);
 				}
-
-				fclose(file);
-				fclose(temp);
-
-				temp = fopen("temp.txt", "r");
-				file = fopen(command->args[2],"w");
-
-				while(fgets(line, MAX_LINE_LENGTH, temp) != NULL){
-					fprintf(file, "%s", line);
-				}
-
-				fclose(file);
-				fclose(temp);
-
-				remove("temp.txt");
-				remove("unique.txt");
-
+				fprintf(out, "\n");
+				if(strcmp(mode, "-l") == 0)
+					word_set_clear(seen);
+			}
+			bool failed = ferror(file);
+			free(line);
+			free(folded);
+			word_set_free(seen);
+			fclose(file);
+			fclose(out);
+			if(failed){ // e.g. a truncated archive, keep the file as it is
+				printf("Error reading the file: %s\n", file_name);
 				exit(0);
-				
-			} else {
-				printf("Invalid arguments\n");
+			}
+
+			// a compressed file is not rewritten, the result goes to stdout
+			FILE *dest = compressed ? stdout : fopen(file_name, "w");
+			if(dest == NULL){
+				printf("Error opening the file: %s\n", file_name);
 				exit(0);
 			}
+			fwrite(result, 1, result_size, dest);
+			if(!compressed)
+				fclose(dest);
+			free(result);
+			exit(0);
 		}
 
 		//execvp(command->name, command->args); // exec+args+path
@@ -671,6 +1638,13 @@ int process_command(struct command_t *command)
 		/// TODO: do your own exec with path resolving using execv()
 
 		/** PART 1 **/
+		// a name with a slash is a path to the program, PATH is not searched
+		if(strchr(command->name, '/') != NULL){
+			execv(command->name, command->args);
+			printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+			exit(UNKNOWN);
+		}
+
 		char *env_path = getenv("PATH");
 		char *token = strtok(env_path, ":");
 		char *path = calloc(200, sizeof(char));
@@ -687,9 +1661,15 @@ int process_command(struct command_t *command)
 	else
 	{
 		if (!command->background)
-			wait(0); // wait for child process to finish
-		
-		if(strcmp(command->name, "shortdir") == 0 && strcmp(command->args[0], "jump") == 0){
+		{
+			// wait for child process to finish, keeping its resource usage
+			struct rusage usage;
+			int status;
+			if (wait4(pid, &status, 0, &usage)==pid)
+				stats_record(command, now_ms()-fork_start, spawn_ms, &usage);
+		}
+
+		if(strcmp(command->name, "shortdir") == 0 && command->arg_count > 0 && strcmp(command->args[0], "jump") == 0){
 			close(pipe_buff[1]);
 			char dir[300];
 			read(pipe_buff[0], dir, 300);
@@ -700,16 +1680,24 @@ int process_command(struct command_t *command)
 				r = chdir(dir);
 				if (r == -1)
 					printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+				else
+					update_cwd();
 			}
 		}
-		
+		else
+		{
+			close(pipe_buff[0]);
+			close(pipe_buff[1]);
+		}
+
 		return SUCCESS;
 	}
 
 	// TODO: your implementation here
 
+	// only the child gets here, when exec failed for every PATH entry
 	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+	exit(UNKNOWN);
 }
 
 int shortdir_del(char *short_name, char *file_name, int MAX_LINE_LENGTH){
@@ -752,24 +1740,31 @@ int shortdir_del(char *short_name, char *file_name, int MAX_LINE_LENGTH){
 	return SUCCESS;
 }
 
+/**
+ * kdiff works on .txt files, compressed ones included
+ */
+bool is_text_name(char *file_name){
+	return fnmatch("*.txt", file_name, 0) == 0 || fnmatch("*.txt.gz", file_name, 0) == 0
+		|| fnmatch("*.txt.zst", file_name, 0) == 0;
+}
+
 int kdiff(int mod, char *file1_name, char *file2_name){
 	int MAX_LINE_LENGTH = 500;
 
 	FILE *file1;
 	FILE *file2;
 
-	char *text_pattern = "*.txt";
-	if(fnmatch(text_pattern, file1_name, 0) != 0 && fnmatch(text_pattern, file2_name, 0) != 0){
+	if(!is_text_name(file1_name) || !is_text_name(file2_name)){
 		printf("please enter .txt files\n");
 		exit(0);
 	}
 	
 	if(mod == 0){
-		file1 = fopen(file1_name, "r");
-		file2 = fopen(file2_name, "r");
+		file1 = input_open(file1_name, "r", NULL);
+		file2 = input_open(file2_name, "r", NULL);
 	} else {
-		file1 = fopen(file1_name, "rb");
-		file2 = fopen(file2_name, "rb");
+		file1 = input_open(file1_name, "rb", NULL);
+		file2 = input_open(file2_name, "rb", NULL);
 	}
 
 	if(file1 == NULL && file2 == NULL){
@@ -792,7 +1787,8 @@ int kdiff(int mod, char *file1_name, char *file2_name){
 
 		fgets(line1, MAX_LINE_LENGTH, file1);
 		fgets(line2, MAX_LINE_LENGTH, file2);
-		while(!feof(file1) && !feof(file2)){
+		// ferror: a damaged archive ends the comparison like an end of file
+		while(!feof(file1) && !feof(file2) && !ferror(file1) && !ferror(file2)){
 			if(strcmp(line1, line2) != 0){
 				printf("%s:Line %d: %s", file1_name, counter, line1);
 				printf("%s:Line %d: %s", file2_name, counter, line2);
@@ -803,7 +1799,7 @@ int kdiff(int mod, char *file1_name, char *file2_name){
 			counter++;
 		}
 	
-		while(!feof(file1))	{
+		while(!feof(file1) && !ferror(file1) && !ferror(file2))	{
 			printf("%s:Line %d: %s", file1_name, counter, line1);
 			printf("%s:Line %d: NULL\n", file2_name, counter);
 			fgets(line1, MAX_LINE_LENGTH, file1);
@@ -811,7 +1807,7 @@ int kdiff(int mod, char *file1_name, char *file2_name){
 			counter++;
 		}
 	
-		while(!feof(file2))	{
+		while(!feof(file2) && !ferror(file2) && !ferror(file1))	{
 			printf("%s:Line %d: NULL\n", file1_name, counter);
 			printf("%s:Line %d: %s", file2_name, counter, line2);
 			fgets(line2, MAX_LINE_LENGTH, file2);
@@ -823,32 +1819,34 @@ int kdiff(int mod, char *file1_name, char *file2_name){
 		free(line2);
 
 	} else { //mod -b
-		int char1;
-		int char2;
-		char1 = getc(file1);
-		char2 = getc(file2);
-			
-		while(char1 != EOF && char2 != EOF){
-			if(char1 != char2){
-				diffcounter++;
-			}
-			char1 = getc(file1);
-			char2 = getc(file2);
-		}
-
-		while(char1 != EOF){
-			diffcounter++;
-			char1 = getc(file1);
-		}
-
-		while(char2 != EOF){
-			diffcounter++;
-			char2 = getc(file2);
-		}
-
+		// compared a block at a time, getc per byte was slower than the disk
+		int BLOCK_LENGTH = 65536;
+		unsigned char *block1 = malloc(BLOCK_LENGTH);
+		unsigned char *block2 = malloc(BLOCK_LENGTH);
+		size_t n1;
+		size_t n2;
+
+		do {
+			n1 = fread(block1, 1, BLOCK_LENGTH, file1);
+			n2 = fread(block2, 1, BLOCK_LENGTH, file2);
+			size_t n = n1 < n2 ? n1 : n2;
+			for(size_t i = 0; i < n; i++)
+				diffcounter += block1[i] != block2[i];
+			diffcounter += n1 + n2 - 2 * n; // bytes past the end of the shorter file
+		} while(n1 == (size_t)BLOCK_LENGTH && n2 == (size_t)BLOCK_LENGTH);
+
+		while((n1 = fread(block1, 1, BLOCK_LENGTH, file1)) > 0)
+			diffcounter += n1;
+		while((n2 = fread(block2, 1, BLOCK_LENGTH, file2)) > 0)
+			diffcounter += n2;
+
+		free(block1);
+		free(block2);
 	}
 	
-	if(diffcounter == 0){
+	if(ferror(file1) || ferror(file2)){
+		printf("Error reading the file: %s\n", ferror(file1) ? file1_name : file2_name);
+	} else if(diffcounter == 0){
 		printf("The two files are identical\n");
 	} else if (mod == 0){
 		printf("%d different lines found\n", diffcounter);
@@ -862,26 +1860,1881 @@ int kdiff(int mod, char *file1_name, char *file2_name){
 	return SUCCESS;
 }
 
-char *toLower(char *tok) {
-    char *token = strdup(tok);
-    for (int i = 0; i < strlen(token); i++) {
-        if (*(token+i) >= 65 && *(token+i) <= 90) 
-			*(token+i)= *(token+i)+32;
-	}
-    return token;
+/**
+ * kdiff -r: compare two directory trees. Directories are walked by a pool
+ * of threads sharing a queue of relative paths still to visit; every
+ * directory is opened with openat() under both roots and listed with
+ * getdents64. Files present in both trees are first compared by metadata,
+ * only files of equal size but different mtime are read.
+ */
+struct tree_entry {
+	char *name;
+	unsigned char type;
+};
+
+struct tree_change {
+	char kind; // 'A'dded, 'D'eleted, 'M'odified or 'E' cannot be read
+	char *path;
+};
+
+struct tree_walk {
+	int root1;
+	int root2;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **queue;
+	int queue_len;
+	int queue_cap;
+	int busy; // workers in the middle of a directory
+	struct tree_change *changes;
+	long change_count;
+	long change_cap;
+	bool content; // read files even when size and mtime match (-c)
+	long identical;
+	long same_file; // the same inode in both trees, not read
+	long assumed; // same size and mtime, not read unless -c
+	long compared; // read to find out
+};
+
+int compare_entries(const void *a, const void *b){
+	return strcmp(((const struct tree_entry *)a)->name, ((const struct tree_entry *)b)->name);
 }
 
-int isDuplicate(char *word){
-	FILE *filer = fopen("unique.txt", "r");
-	char lline[500];
-	while(fgets(lline, 500, filer) != NULL){
-		lline[strcspn(lline,"\n")] = '\0';
-		if(strcmp(lline, word) == 0){
-			fclose(filer);
-			return 1;
+int compare_changes(const void *a, const void *b){
+	return strcmp(((const struct tree_change *)a)->path, ((const struct tree_change *)b)->path);
+}
+
+/**
+ * List a directory sorted by name, without . and ..
+ * @return number of entries, -1 if it cannot be read
+ */
+int tree_list(int dir_fd, struct tree_entry **entries){
+	char buf[32768];
+	int count = 0;
+	int cap = 0;
+	long n;
+
+	*entries = NULL;
+	while((n = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0){
+		for(long off = 0; off < n;){
+			struct dirent64 *d = (struct dirent64 *)(buf + off);
+			off += d->d_reclen;
+			if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+				continue;
+			if(count == cap){
+				cap = cap ? cap * 2 : 64;
+				*entries = realloc(*entries, sizeof(struct tree_entry) * cap);
+			}
+			(*entries)[count].name = strdup(d->d_name);
+			(*entries)[count].type = d->d_type;
+			count++;
 		}
 	}
+	if(n < 0){
+		for(int i = 0; i < count; i++)
+			free((*entries)[i].name);
+		free(*entries);
+		*entries = NULL;
+		return -1;
+	}
 
-	fclose(filer);
-	return 0;
-}
\ No newline at end of file
+	qsort(*entries, count, sizeof(struct tree_entry), compare_entries);
+	return count;
+}
+
+/**
+ * Read until buf is full or the file ends, short reads (NFS, FUSE) and
+ * EINTR are retried
+ * @return bytes read, -1 on error
+ */
+ssize_t tree_read_full(int fd, char *buf, size_t size){
+	size_t done = 0;
+	while(done < size){
+		ssize_t n = read(fd, buf + done, size - done);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n == -1)
+			return -1;
+		if(n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Compare two regular files of the same name
+ * @return 1 if they differ, 0 if not, -1 if either cannot be read
+ */
+int tree_compare_files(struct tree_walk *walk, int dir1, int dir2, char *name, struct stat *st1, struct stat *st2){
+	if(st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino){
+		__sync_fetch_and_add(&walk->same_file, 1);
+		return 0;
+	}
+	if(st1->st_size != st2->st_size)
+		return 1;
+	// the same quick check as rsync: a matching size and mtime is taken as
+	// identical, -c reads them for files written in the same mtime tick
+	if(!walk->content && st1->st_mtim.tv_sec == st2->st_mtim.tv_sec && st1->st_mtim.tv_nsec == st2->st_mtim.tv_nsec){
+		__sync_fetch_and_add(&walk->assumed, 1);
+		return 0;
+	}
+
+	__sync_fetch_and_add(&walk->compared, 1);
+	int fd1 = openat(dir1, name, O_RDONLY | O_CLOEXEC);
+	int fd2 = openat(dir2, name, O_RDONLY | O_CLOEXEC);
+	int differ = fd1 == -1 || fd2 == -1 ? -1 : 0;
+	char buf1[65536];
+	char buf2[65536];
+	while(differ == 0){
+		ssize_t n1 = tree_read_full(fd1, buf1, sizeof(buf1));
+		ssize_t n2 = tree_read_full(fd2, buf2, sizeof(buf2));
+		if(n1 == -1 || n2 == -1)
+			differ = -1;
+		else if(n1 != n2 || memcmp(buf1, buf2, n1) != 0)
+			differ = 1;
+		else if(n1 == 0)
+			break;
+	}
+	if(fd1 != -1) close(fd1);
+	if(fd2 != -1) close(fd2);
+	return differ;
+}
+
+/**
+ * Type of an entry, asking the file system when getdents did not say
+ */
+unsigned char tree_type(int dir_fd, struct tree_entry *entry, struct stat *st){
+	if(fstatat(dir_fd, entry->name, st, AT_SYMLINK_NOFOLLOW) == -1)
+		return entry->type;
+	if(S_ISDIR(st->st_mode)) return DT_DIR;
+	if(S_ISREG(st->st_mode)) return DT_REG;
+	if(S_ISLNK(st->st_mode)) return DT_LNK;
+	return DT_UNKNOWN;
+}
+
+void tree_add_change(struct tree_change **changes, long *count, long *cap, char kind, char *rel, char *name, bool is_dir){
+	if(*count == *cap){
+		*cap = *cap ? *cap * 2 : 64;
+		*changes = realloc(*changes, sizeof(struct tree_change) * *cap);
+	}
+	(*changes)[*count].kind = kind;
+	if(asprintf(&(*changes)[*count].path, "%s%s%s%s", rel, *rel ? "/" : "", name, is_dir ? "/" : "") == -1)
+		(*changes)[*count].path = strdup(name);
+	(*count)++;
+}
+
+/**
+ * Compare one directory present in both trees. Subdirectories found in
+ * both are queued, changes are collected locally and added at the end.
+ */
+void tree_visit(struct tree_walk *walk, char *rel){
+	const char *path = *rel ? rel : ".";
+	int dir1 = openat(walk->root1, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int dir2 = openat(walk->root2, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct tree_entry *list1 = NULL;
+	struct tree_entry *list2 = NULL;
+	int count1 = dir1 == -1 ? -1 : tree_list(dir1, &list1);
+	int count2 = dir2 == -1 ? -1 : tree_list(dir2, &list2);
+	struct tree_change *changes = NULL;
+	long change_count = 0;
+	long change_cap = 0;
+	long identical = 0;
+
+	// a directory that cannot be listed on either side is reported, its
+	// entries are not compared
+	if(count1 == -1 || count2 == -1)
+		tree_add_change(&changes, &change_count, &change_cap, 'E', "", (char *)path, true);
+
+	// both lists are sorted, walk them like a merge
+	int i = 0;
+	int j = 0;
+	while(count1 != -1 && count2 != -1 && (i < count1 || j < count2)){
+		int cmp = i == count1 ? 1 : j == count2 ? -1 : strcmp(list1[i].name, list2[j].name);
+		if(cmp < 0){
+			tree_add_change(&changes, &change_count, &change_cap, 'D', rel, list1[i].name, list1[i].type == DT_DIR);
+			i++;
+			continue;
+		}
+		if(cmp > 0){
+			tree_add_change(&changes, &change_count, &change_cap, 'A', rel, list2[j].name, list2[j].type == DT_DIR);
+			j++;
+			continue;
+		}
+
+		struct stat st1;
+		struct stat st2;
+		char *name = list1[i].name;
+		unsigned char type1 = tree_type(dir1, &list1[i], &st1);
+		unsigned char type2 = tree_type(dir2, &list2[j], &st2);
+		int differ = type1 != type2;
+
+		if(!differ && type1 == DT_DIR){
+			char *sub;
+			if(asprintf(&sub, "%s%s%s", rel, *rel ? "/" : "", name) != -1){
+				pthread_mutex_lock(&walk->lock);
+				if(walk->queue_len == walk->queue_cap){
+					walk->queue_cap = walk->queue_cap ? walk->queue_cap * 2 : 64;
+					walk->queue = realloc(walk->queue, sizeof(char *) * walk->queue_cap);
+				}
+				walk->queue[walk->queue_len++] = sub;
+				pthread_cond_signal(&walk->cond);
+				pthread_mutex_unlock(&walk->lock);
+			}
+		} else if(!differ && type1 == DT_REG){
+			differ = tree_compare_files(walk, dir1, dir2, name, &st1, &st2);
+		} else if(!differ && type1 == DT_LNK){
+			char target1[PATH_MAX];
+			char target2[PATH_MAX];
+			ssize_t n1 = readlinkat(dir1, name, target1, sizeof(target1));
+			ssize_t n2 = readlinkat(dir2, name, target2, sizeof(target2));
+			if(n1 < 0 || n2 < 0)
+				differ = -1;
+			else
+				differ = n1 != n2 || memcmp(target1, target2, n1) != 0;
+		}
+
+		if(differ == -1) // neither changed nor identical, the user has to look
+			tree_add_change(&changes, &change_count, &change_cap, 'E', rel, name, false);
+		else if(differ)
+			tree_add_change(&changes, &change_count, &change_cap, 'M', rel, name, type1 == DT_DIR && type2 == DT_DIR);
+		else if(type1 != DT_DIR)
+			identical++;
+		i++;
+		j++;
+	}
+
+	pthread_mutex_lock(&walk->lock);
+	if(walk->change_count + change_count > walk->change_cap){
+		walk->change_cap = (walk->change_count + change_count) * 2;
+		walk->changes = realloc(walk->changes, sizeof(struct tree_change) * walk->change_cap);
+	}
+	if(change_count > 0)
+		memcpy(walk->changes + walk->change_count, changes, sizeof(struct tree_change) * change_count);
+	walk->change_count += change_count;
+	walk->identical += identical;
+	pthread_mutex_unlock(&walk->lock);
+
+	free(changes);
+	for(int k = 0; k < count1; k++)
+		free(list1[k].name);
+	for(int k = 0; k < count2; k++)
+		free(list2[k].name);
+	free(list1);
+	free(list2);
+	if(dir1 != -1) close(dir1);
+	if(dir2 != -1) close(dir2);
+}
+
+/**
+ * Worker thread, takes directories from the queue until the queue is empty
+ * and no other worker can add to it anymore
+ */
+void *tree_worker(void *arg){
+	struct tree_walk *walk = arg;
+
+	pthread_mutex_lock(&walk->lock);
+	while(1){
+		while(walk->queue_len == 0 && walk->busy > 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if(walk->queue_len == 0)
+			break;
+
+		char *rel = walk->queue[--walk->queue_len];
+		walk->busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		tree_visit(walk, rel);
+		free(rel);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->busy--;
+		if(walk->queue_len == 0 && walk->busy == 0)
+			pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+int kdiff_tree(char *dir1_name, char *dir2_name, bool content){
+	struct tree_walk walk;
+	memset(&walk, 0, sizeof(walk));
+	walk.content = content;
+
+	walk.root1 = open(dir1_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	walk.root2 = open(dir2_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(walk.root1 == -1 || walk.root2 == -1){
+		printf("Cannot open directory: %s\n", walk.root1 == -1 ? dir1_name : dir2_name);
+		return SUCCESS;
+	}
+
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	walk.queue = malloc(sizeof(char *));
+	walk.queue_cap = 1;
+	walk.queue[walk.queue_len++] = strdup("");
+
+	// the walk mostly waits on the disk, so use more threads than cores
+	int thread_count = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	if(thread_count < 2) thread_count = 2;
+	if(thread_count > 32) thread_count = 32;
+	pthread_t threads[32];
+	int started = 0;
+	for(int i = 0; i < thread_count; i++)
+		if(pthread_create(&threads[started], NULL, tree_worker, &walk) == 0)
+			started++;
+	if(started == 0) // no threads, walk in this one
+		tree_worker(&walk);
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	qsort(walk.changes, walk.change_count, sizeof(struct tree_change), compare_changes);
+	long added = 0;
+	long removed = 0;
+	long unreadable = 0;
+	for(long i = 0; i < walk.change_count; i++){
+		struct tree_change *change = &walk.changes[i];
+		if(change->kind == 'A'){
+			printf("Added:    %s\n", change->path);
+			added++;
+		} else if(change->kind == 'D'){
+			printf("Removed:  %s\n", change->path);
+			removed++;
+		} else if(change->kind == 'E'){
+			printf("Unreadable: %s\n", change->path);
+			unreadable++;
+		} else {
+			printf("Changed:  %s\n", change->path);
+		}
+		free(change->path);
+	}
+
+	if(walk.change_count == 0)
+		printf("The two directories are identical\n");
+	printf("%ld added, %ld removed, %ld changed, %ld identical (%ld same file, %ld compared)",
+		added, removed, walk.change_count - added - removed - unreadable, walk.identical - walk.assumed, walk.same_file, walk.compared);
+	if(!content)
+		printf(", %ld assumed identical by size and mtime", walk.assumed);
+	if(unreadable > 0)
+		printf(", %ld unreadable", unreadable);
+	printf("\n");
+
+	free(walk.changes);
+	free(walk.queue);
+	close(walk.root1);
+	close(walk.root2);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_cond_destroy(&walk.cond);
+	return SUCCESS;
+}
+
+/**
+ * Case folding and token classification shared by highlight and unique.
+ * ASCII is folded eight bytes at a time and through fold_table, two byte
+ * UTF-8 sequences are decoded and folded per code point. Folding never
+ * makes a string longer, so it can be done in place.
+ */
+const unsigned char fold_table[256] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+	0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+	0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+	0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+	0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+	0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+	0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+const unsigned char char_class[256] = {
+	['\t'] = CHAR_BLANK, ['\n'] = CHAR_BLANK, ['\r'] = CHAR_BLANK, [' '] = CHAR_BLANK,
+	[':'] = CHAR_PUNCT, [';'] = CHAR_PUNCT, ['.'] = CHAR_PUNCT, [','] = CHAR_PUNCT,
+};
+
+/**
+ * Simple case folding of the code points encoded in two UTF-8 bytes, 0
+ * where a code point folds to itself. These are the C and S entries of
+ * CaseFolding.txt (Unicode 14.0) below U+0800, except U+023A and U+023E:
+ * they fold to three byte characters, which would break folding in place.
+ * Generated with
+ *   gawk -F'; ' '$2 ~ /^[CS]$/ { c = strtonum("0x" $1); f = strtonum("0x" $3);
+ *     if(c >= 0x80 && c < 0x800 && f < 0x800) printf "[0x%03x] = 0x%03x,\n", c, f }' CaseFolding.txt
+ */
+const unsigned short fold_table_2byte[0x800] = {
+	[0x0b5] = 0x3bc, [0x0c0] = 0x0e0, [0x0c1] = 0x0e1, [0x0c2] = 0x0e2, [0x0c3] = 0x0e3, [0x0c4] = 0x0e4,
+	[0x0c5] = 0x0e5, [0x0c6] = 0x0e6, [0x0c7] = 0x0e7, [0x0c8] = 0x0e8, [0x0c9] = 0x0e9, [0x0ca] = 0x0ea,
+	[0x0cb] = 0x0eb, [0x0cc] = 0x0ec, [0x0cd] = 0x0ed, [0x0ce] = 0x0ee, [0x0cf] = 0x0ef, [0x0d0] = 0x0f0,
+	[0x0d1] = 0x0f1, [0x0d2] = 0x0f2, [0x0d3] = 0x0f3, [0x0d4] = 0x0f4, [0x0d5] = 0x0f5, [0x0d6] = 0x0f6,
+	[0x0d8] = 0x0f8, [0x0d9] = 0x0f9, [0x0da] = 0x0fa, [0x0db] = 0x0fb, [0x0dc] = 0x0fc, [0x0dd] = 0x0fd,
+	[0x0de] = 0x0fe, [0x100] = 0x101, [0x102] = 0x103, [0x104] = 0x105, [0x106] = 0x107, [0x108] = 0x109,
+	[0x10a] = 0x10b, [0x10c] = 0x10d, [0x10e] = 0x10f, [0x110] = 0x111, [0x112] = 0x113, [0x114] = 0x115,
+	[0x116] = 0x117, [0x118] = 0x119, [0x11a] = 0x11b, [0x11c] = 0x11d, [0x11e] = 0x11f, [0x120] = 0x121,
+	[0x122] = 0x123, [0x124] = 0x125, [0x126] = 0x127, [0x128] = 0x129, [0x12a] = 0x12b, [0x12c] = 0x12d,
+	[0x12e] = 0x12f, [0x132] = 0x133, [0x134] = 0x135, [0x136] = 0x137, [0x139] = 0x13a, [0x13b] = 0x13c,
+	[0x13d] = 0x13e, [0x13f] = 0x140, [0x141] = 0x142, [0x143] = 0x144, [0x145] = 0x146, [0x147] = 0x148,
+	[0x14a] = 0x14b, [0x14c] = 0x14d, [0x14e] = 0x14f, [0x150] = 0x151, [0x152] = 0x153, [0x154] = 0x155,
+	[0x156] = 0x157, [0x158] = 0x159, [0x15a] = 0x15b, [0x15c] = 0x15d, [0x15e] = 0x15f, [0x160] = 0x161,
+	[0x162] = 0x163, [0x164] = 0x165, [0x166] = 0x167, [0x168] = 0x169, [0x16a] = 0x16b, [0x16c] = 0x16d,
+	[0x16e] = 0x16f, [0x170] = 0x171, [0x172] = 0x173, [0x174] = 0x175, [0x176] = 0x177, [0x178] = 0x0ff,
+	[0x179] = 0x17a, [0x17b] = 0x17c, [0x17d] = 0x17e, [0x17f] = 0x073, [0x181] = 0x253, [0x182] = 0x183,
+	[0x184] = 0x185, [0x186] = 0x254, [0x187] = 0x188, [0x189] = 0x256, [0x18a] = 0x257, [0x18b] = 0x18c,
+	[0x18e] = 0x1dd, [0x18f] = 0x259, [0x190] = 0x25b, [0x191] = 0x192, [0x193] = 0x260, [0x194] = 0x263,
+	[0x196] = 0x269, [0x197] = 0x268, [0x198] = 0x199, [0x19c] = 0x26f, [0x19d] = 0x272, [0x19f] = 0x275,
+	[0x1a0] = 0x1a1, [0x1a2] = 0x1a3, [0x1a4] = 0x1a5, [0x1a6] = 0x280, [0x1a7] = 0x1a8, [0x1a9] = 0x283,
+	[0x1ac] = 0x1ad, [0x1ae] = 0x288, [0x1af] = 0x1b0, [0x1b1] = 0x28a, [0x1b2] = 0x28b, [0x1b3] = 0x1b4,
+	[0x1b5] = 0x1b6, [0x1b7] = 0x292, [0x1b8] = 0x1b9, [0x1bc] = 0x1bd, [0x1c4] = 0x1c6, [0x1c5] = 0x1c6,
+	[0x1c7] = 0x1c9, [0x1c8] = 0x1c9, [0x1ca] = 0x1cc, [0x1cb] = 0x1cc, [0x1cd] = 0x1ce, [0x1cf] = 0x1d0,
+	[0x1d1] = 0x1d2, [0x1d3] = 0x1d4, [0x1d5] = 0x1d6, [0x1d7] = 0x1d8, [0x1d9] = 0x1da, [0x1db] = 0x1dc,
+	[0x1de] = 0x1df, [0x1e0] = 0x1e1, [0x1e2] = 0x1e3, [0x1e4] = 0x1e5, [0x1e6] = 0x1e7, [0x1e8] = 0x1e9,
+	[0x1ea] = 0x1eb, [0x1ec] = 0x1ed, [0x1ee] = 0x1ef, [0x1f1] = 0x1f3, [0x1f2] = 0x1f3, [0x1f4] = 0x1f5,
+	[0x1f6] = 0x195, [0x1f7] = 0x1bf, [0x1f8] = 0x1f9, [0x1fa] = 0x1fb, [0x1fc] = 0x1fd, [0x1fe] = 0x1ff,
+	[0x200] = 0x201, [0x202] = 0x203, [0x204] = 0x205, [0x206] = 0x207, [0x208] = 0x209, [0x20a] = 0x20b,
+	[0x20c] = 0x20d, [0x20e] = 0x20f, [0x210] = 0x211, [0x212] = 0x213, [0x214] = 0x215, [0x216] = 0x217,
+	[0x218] = 0x219, [0x21a] = 0x21b, [0x21c] = 0x21d, [0x21e] = 0x21f, [0x220] = 0x19e, [0x222] = 0x223,
+	[0x224] = 0x225, [0x226] = 0x227, [0x228] = 0x229, [0x22a] = 0x22b, [0x22c] = 0x22d, [0x22e] = 0x22f,
+	[0x230] = 0x231, [0x232] = 0x233, [0x23b] = 0x23c, [0x23d] = 0x19a, [0x241] = 0x242, [0x243] = 0x180,
+	[0x244] = 0x289, [0x245] = 0x28c, [0x246] = 0x247, [0x248] = 0x249, [0x24a] = 0x24b, [0x24c] = 0x24d,
+	[0x24e] = 0x24f, [0x345] = 0x3b9, [0x370] = 0x371, [0x372] = 0x373, [0x376] = 0x377, [0x37f] = 0x3f3,
+	[0x386] = 0x3ac, [0x388] = 0x3ad, [0x389] = 0x3ae, [0x38a] = 0x3af, [0x38c] = 0x3cc, [0x38e] = 0x3cd,
+	[0x38f] = 0x3ce, [0x391] = 0x3b1, [0x392] = 0x3b2, [0x393] = 0x3b3, [0x394] = 0x3b4, [0x395] = 0x3b5,
+	[0x396] = 0x3b6, [0x397] = 0x3b7, [0x398] = 0x3b8, [0x399] = 0x3b9, [0x39a] = 0x3ba, [0x39b] = 0x3bb,
+	[0x39c] = 0x3bc, [0x39d] = 0x3bd, [0x39e] = 0x3be, [0x39f] = 0x3bf, [0x3a0] = 0x3c0, [0x3a1] = 0x3c1,
+	[0x3a3] = 0x3c3, [0x3a4] = 0x3c4, [0x3a5] = 0x3c5, [0x3a6] = 0x3c6, [0x3a7] = 0x3c7, [0x3a8] = 0x3c8,
+	[0x3a9] = 0x3c9, [0x3aa] = 0x3ca, [0x3ab] = 0x3cb, [0x3c2] = 0x3c3, [0x3cf] = 0x3d7, [0x3d0] = 0x3b2,
+	[0x3d1] = 0x3b8, [0x3d5] = 0x3c6, [0x3d6] = 0x3c0, [0x3d8] = 0x3d9, [0x3da] = 0x3db, [0x3dc] = 0x3dd,
+	[0x3de] = 0x3df, [0x3e0] = 0x3e1, [0x3e2] = 0x3e3, [0x3e4] = 0x3e5, [0x3e6] = 0x3e7, [0x3e8] = 0x3e9,
+	[0x3ea] = 0x3eb, [0x3ec] = 0x3ed, [0x3ee] = 0x3ef, [0x3f0] = 0x3ba, [0x3f1] = 0x3c1, [0x3f4] = 0x3b8,
+	[0x3f5] = 0x3b5, [0x3f7] = 0x3f8, [0x3f9] = 0x3f2, [0x3fa] = 0x3fb, [0x3fd] = 0x37b, [0x3fe] = 0x37c,
+	[0x3ff] = 0x37d, [0x400] = 0x450, [0x401] = 0x451, [0x402] = 0x452, [0x403] = 0x453, [0x404] = 0x454,
+	[0x405] = 0x455, [0x406] = 0x456, [0x407] = 0x457, [0x408] = 0x458, [0x409] = 0x459, [0x40a] = 0x45a,
+	[0x40b] = 0x45b, [0x40c] = 0x45c, [0x40d] = 0x45d, [0x40e] = 0x45e, [0x40f] = 0x45f, [0x410] = 0x430,
+	[0x411] = 0x431, [0x412] = 0x432, [0x413] = 0x433, [0x414] = 0x434, [0x415] = 0x435, [0x416] = 0x436,
+	[0x417] = 0x437, [0x418] = 0x438, [0x419] = 0x439, [0x41a] = 0x43a, [0x41b] = 0x43b, [0x41c] = 0x43c,
+	[0x41d] = 0x43d, [0x41e] = 0x43e, [0x41f] = 0x43f, [0x420] = 0x440, [0x421] = 0x441, [0x422] = 0x442,
+	[0x423] = 0x443, [0x424] = 0x444, [0x425] = 0x445, [0x426] = 0x446, [0x427] = 0x447, [0x428] = 0x448,
+	[0x429] = 0x449, [0x42a] = 0x44a, [0x42b] = 0x44b, [0x42c] = 0x44c, [0x42d] = 0x44d, [0x42e] = 0x44e,
+	[0x42f] = 0x44f, [0x460] = 0x461, [0x462] = 0x463, [0x464] = 0x465, [0x466] = 0x467, [0x468] = 0x469,
+	[0x46a] = 0x46b, [0x46c] = 0x46d, [0x46e] = 0x46f, [0x470] = 0x471, [0x472] = 0x473, [0x474] = 0x475,
+	[0x476] = 0x477, [0x478] = 0x479, [0x47a] = 0x47b, [0x47c] = 0x47d, [0x47e] = 0x47f, [0x480] = 0x481,
+	[0x48a] = 0x48b, [0x48c] = 0x48d, [0x48e] = 0x48f, [0x490] = 0x491, [0x492] = 0x493, [0x494] = 0x495,
+	[0x496] = 0x497, [0x498] = 0x499, [0x49a] = 0x49b, [0x49c] = 0x49d, [0x49e] = 0x49f, [0x4a0] = 0x4a1,
+	[0x4a2] = 0x4a3, [0x4a4] = 0x4a5, [0x4a6] = 0x4a7, [0x4a8] = 0x4a9, [0x4aa] = 0x4ab, [0x4ac] = 0x4ad,
+	[0x4ae] = 0x4af, [0x4b0] = 0x4b1, [0x4b2] = 0x4b3, [0x4b4] = 0x4b5, [0x4b6] = 0x4b7, [0x4b8] = 0x4b9,
+	[0x4ba] = 0x4bb, [0x4bc] = 0x4bd, [0x4be] = 0x4bf, [0x4c0] = 0x4cf, [0x4c1] = 0x4c2, [0x4c3] = 0x4c4,
+	[0x4c5] = 0x4c6, [0x4c7] = 0x4c8, [0x4c9] = 0x4ca, [0x4cb] = 0x4cc, [0x4cd] = 0x4ce, [0x4d0] = 0x4d1,
+	[0x4d2] = 0x4d3, [0x4d4] = 0x4d5, [0x4d6] = 0x4d7, [0x4d8] = 0x4d9, [0x4da] = 0x4db, [0x4dc] = 0x4dd,
+	[0x4de] = 0x4df, [0x4e0] = 0x4e1, [0x4e2] = 0x4e3, [0x4e4] = 0x4e5, [0x4e6] = 0x4e7, [0x4e8] = 0x4e9,
+	[0x4ea] = 0x4eb, [0x4ec] = 0x4ed, [0x4ee] = 0x4ef, [0x4f0] = 0x4f1, [0x4f2] = 0x4f3, [0x4f4] = 0x4f5,
+	[0x4f6] = 0x4f7, [0x4f8] = 0x4f9, [0x4fa] = 0x4fb, [0x4fc] = 0x4fd, [0x4fe] = 0x4ff, [0x500] = 0x501,
+	[0x502] = 0x503, [0x504] = 0x505, [0x506] = 0x507, [0x508] = 0x509, [0x50a] = 0x50b, [0x50c] = 0x50d,
+	[0x50e] = 0x50f, [0x510] = 0x511, [0x512] = 0x513, [0x514] = 0x515, [0x516] = 0x517, [0x518] = 0x519,
+	[0x51a] = 0x51b, [0x51c] = 0x51d, [0x51e] = 0x51f, [0x520] = 0x521, [0x522] = 0x523, [0x524] = 0x525,
+	[0x526] = 0x527, [0x528] = 0x529, [0x52a] = 0x52b, [0x52c] = 0x52d, [0x52e] = 0x52f, [0x531] = 0x561,
+	[0x532] = 0x562, [0x533] = 0x563, [0x534] = 0x564, [0x535] = 0x565, [0x536] = 0x566, [0x537] = 0x567,
+	[0x538] = 0x568, [0x539] = 0x569, [0x53a] = 0x56a, [0x53b] = 0x56b, [0x53c] = 0x56c, [0x53d] = 0x56d,
+	[0x53e] = 0x56e, [0x53f] = 0x56f, [0x540] = 0x570, [0x541] = 0x571, [0x542] = 0x572, [0x543] = 0x573,
+	[0x544] = 0x574, [0x545] = 0x575, [0x546] = 0x576, [0x547] = 0x577, [0x548] = 0x578, [0x549] = 0x579,
+	[0x54a] = 0x57a, [0x54b] = 0x57b, [0x54c] = 0x57c, [0x54d] = 0x57d, [0x54e] = 0x57e, [0x54f] = 0x57f,
+	[0x550] = 0x580, [0x551] = 0x581, [0x552] = 0x582, [0x553] = 0x583, [0x554] = 0x584, [0x555] = 0x585,
+	[0x556] = 0x586,
+};
+
+unsigned fold_code_point(unsigned c){
+	if(c == 0x130) // capital I with dot above only has a full folding, to "i" and a dot
+		return 'i';
+	return fold_table_2byte[c] ? fold_table_2byte[c] : c;
+}
+
+/**
+ * Folds the case of len bytes of src into dst, which may be src itself.
+ * Longer UTF-8 sequences and invalid bytes are copied unchanged.
+ * @return the length of the folded string, never more than len
+ */
+size_t case_fold(char *dst, const char *src, size_t len){
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	size_t i = 0, o = 0;
+	while(i < len){
+		// eight ASCII bytes at a time: a byte is upper case when adding
+		// 0x80 - 'A' sets its top bit and adding 0x7f - 'Z' does not
+		while(i + 8 <= len){
+			uint64_t word;
+			memcpy(&word, in + i, 8);
+			if(word & 0x8080808080808080ULL)
+				break;
+			uint64_t upper = (word + 0x3f3f3f3f3f3f3f3fULL) & ~(word + 0x2525252525252525ULL);
+			word |= (upper & 0x8080808080808080ULL) >> 2;
+			memcpy(out + o, &word, 8);
+			i += 8;
+			o += 8;
+		}
+		if(i == len)
+			break;
+
+		unsigned char c = in[i];
+		if(c < 0x80){
+			out[o++] = fold_table[c];
+			i++;
+		} else if(c >= 0xc2 && c <= 0xdf && i + 1 < len && (in[i + 1] & 0xc0) == 0x80){
+			unsigned cp = fold_code_point((c & 0x1f) << 6 | (in[i + 1] & 0x3f));
+			if(cp < 0x80){
+				out[o++] = cp;
+			} else {
+				out[o++] = 0xc0 | cp >> 6;
+				out[o++] = 0x80 | (cp & 0x3f);
+			}
+			i += 2;
+		} else {
+			out[o++] = c;
+			i++;
+		}
+	}
+	return o;
+}
+
+/**
+ * Length of the prefix of s made of bytes of the given classes, like strspn.
+ */
+size_t class_span(const char *s, size_t len, unsigned char classes){
+	size_t i = 0;
+	while(i < len && (char_class[(unsigned char)s[i]] & classes))
+		i++;
+	return i;
+}
+
+/**
+ * Length of the prefix of s made of bytes of none of the classes, like strcspn.
+ */
+size_t class_cspan(const char *s, size_t len, unsigned char classes){
+	size_t i = 0;
+	while(i < len && !(char_class[(unsigned char)s[i]] & classes))
+		i++;
+	return i;
+}
+
+/**
+ * Set of the words unique has seen. Words are copied into an arena and
+ * found through an open addressing table. Clearing the set for the next
+ * line of unique -l only bumps the generation: slots of an older
+ * generation count as empty.
+ */
+struct word_slot {
+	uint64_t hash;
+	size_t offset;
+	size_t length;
+	unsigned generation;
+};
+
+struct word_set {
+	struct word_slot *slots;
+	size_t capacity; // power of two
+	size_t count;
+	unsigned generation;
+	char *arena;
+	size_t arena_used;
+	size_t arena_capacity;
+};
+
+uint64_t word_hash(const char *word, size_t length){
+	uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+	for(size_t i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char)word[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+struct word_set *word_set_new(){
+	struct word_set *set = calloc(1, sizeof(struct word_set));
+	set->capacity = 1024;
+	set->slots = calloc(set->capacity, sizeof(struct word_slot));
+	set->generation = 1;
+	return set;
+}
+
+void word_set_clear(struct word_set *set){
+	set->generation++;
+	set->count = 0;
+	set->arena_used = 0;
+}
+
+void word_set_free(struct word_set *set){
+	free(set->slots);
+	free(set->arena);
+	free(set);
+}
+
+void word_set_grow(struct word_set *set){
+	size_t capacity = set->capacity * 2;
+	struct word_slot *slots = calloc(capacity, sizeof(struct word_slot));
+	for(size_t i = 0; i < set->capacity; i++){
+		struct word_slot *slot = &set->slots[i];
+		if(slot->generation != set->generation)
+			continue;
+		size_t j = slot->hash & (capacity - 1);
+		while(slots[j].generation == set->generation)
+			j = (j + 1) & (capacity - 1);
+		slots[j] = *slot;
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->capacity = capacity;
+}
+
+/**
+ * Adds a word to the set.
+ * @return true if the word was not in the set yet
+ */
+bool word_set_add(struct word_set *set, const char *word, size_t length){
+	if((set->count + 1) * 2 > set->capacity)
+		word_set_grow(set);
+
+	uint64_t hash = word_hash(word, length);
+	size_t i = hash & (set->capacity - 1);
+	while(set->slots[i].generation == set->generation){
+		struct word_slot *slot = &set->slots[i];
+		if(slot->hash == hash && slot->length == length && memcmp(set->arena + slot->offset, word, length) == 0)
+			return false;
+		i = (i + 1) & (set->capacity - 1);
+	}
+
+	if(set->arena_used + length > set->arena_capacity){
+		set->arena_capacity = 2 * (set->arena_capacity + length);
+		set->arena = realloc(set->arena, set->arena_capacity);
+	}
+	memcpy(set->arena + set->arena_used, word, length);
+	set->slots[i] = (struct word_slot){ hash, set->arena_used, length, set->generation };
+	set->arena_used += length;
+	set->count++;
+	return true;
+}
+
+/**
+ * goodMorning alarms are kept in ~/.seashell_jobs, one "id hour minute file"
+ * line per alarm, and played by a scheduler daemon started on demand. The
+ * daemon holds a lock on ~/.seashell_jobs.pid for as long as it runs, so
+ * there is never more than one, and it is told about changes with SIGHUP.
+ */
+struct job {
+	int id;
+	int hour;
+	int minute;
+	char file[PATH_MAX];
+	time_t when; // next time the alarm goes off
+};
+
+void scheduler_path(char *path, int size, const char *suffix)
+{
+	char *home_path = getenv("HOME");
+	snprintf(path, size, "%s/.seashell_jobs%s", home_path?home_path:"", suffix);
+}
+
+/**
+ * Read the job file, the caller frees the array
+ * @param  jobs set to the jobs read
+ * @return      number of jobs
+ */
+int scheduler_load(struct job **jobs){
+	char file_name[PATH_MAX];
+	char line[PATH_MAX+64];
+	int count = 0;
+	int cap = 0;
+
+	*jobs = NULL;
+	scheduler_path(file_name, sizeof(file_name), "");
+	FILE *file = fopen(file_name, "r");
+	if(file == NULL) return 0;
+	flock(fileno(file), LOCK_SH);
+
+	while(fgets(line, sizeof(line), file) != NULL){
+		struct job job;
+		int offset;
+		if(sscanf(line, "%d %d %d %n", &job.id, &job.hour, &job.minute, &offset) != 3)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(job.file, sizeof(job.file), "%s", line + offset);
+		if(count == cap){
+			cap = cap ? cap * 2 : 8;
+			*jobs = realloc(*jobs, sizeof(struct job) * cap);
+		}
+		(*jobs)[count++] = job;
+	}
+
+	fclose(file);
+	return count;
+}
+
+/**
+ * Next local time after now at which an alarm set to hour:minute rings
+ */
+time_t scheduler_next(int hour, int minute, time_t now){
+	struct tm tm;
+	localtime_r(&now, &tm);
+	tm.tm_hour = hour;
+	tm.tm_min = minute;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	time_t when = mktime(&tm);
+	if(when <= now){
+		tm.tm_mday++; // mktime normalizes the date and handles DST changes
+		tm.tm_hour = hour;
+		tm.tm_min = minute;
+		tm.tm_isdst = -1;
+		when = mktime(&tm);
+	}
+	return when;
+}
+
+/**
+ * Min-heap of jobs ordered by the time they go off
+ */
+void heap_sift_down(struct job *heap, int count, int i){
+	while(1){
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = 2 * i + 2;
+		if(left < count && heap[left].when < heap[smallest].when) smallest = left;
+		if(right < count && heap[right].when < heap[smallest].when) smallest = right;
+		if(smallest == i) return;
+		struct job tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+void heap_build(struct job *heap, int count){
+	for(int i = count / 2 - 1; i >= 0; i--)
+		heap_sift_down(heap, count, i);
+}
+
+/**
+ * Play the music of an alarm in a child of the daemon
+ */
+void scheduler_fire(struct job *job){
+	if(fork() != 0) return;
+
+	// undo the daemon's signal setup, both survive exec
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	signal(SIGCHLD, SIG_DFL);
+
+	char runtime_dir[64];
+	snprintf(runtime_dir, sizeof(runtime_dir), "/run/user/%d", (int)getuid());
+	setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+	setenv("DISPLAY", ":0.0", 1);
+	execl("/usr/bin/rhythmbox-client", "rhythmbox-client", "--play", job->file, (char *)NULL);
+	_exit(127);
+}
+
+int scheduler_write_pid(int lock_fd){
+	char pid_text[32];
+	int len = snprintf(pid_text, sizeof(pid_text), "%d\n", (int)getpid());
+	if(ftruncate(lock_fd, 0) == 0 && pwrite(lock_fd, pid_text, len, 0) == len)
+		return SUCCESS;
+	return UNKNOWN;
+}
+
+/**
+ * Empty the pid file, done while the lock is still held so no shell
+ * signals a pid that is gone or reused
+ */
+int scheduler_clear_pid(int lock_fd){
+	return ftruncate(lock_fd, 0) == 0 ? SUCCESS : UNKNOWN;
+}
+
+/**
+ * Signals the daemon reads from its signalfd. They are blocked before its
+ * pid is written, otherwise an early SIGHUP would kill it.
+ */
+void scheduler_signals(sigset_t *mask){
+	sigemptyset(mask);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGTERM);
+}
+
+/**
+ * Main loop of the daemon. Waits on a timerfd armed for the earliest job
+ * and on a signalfd for SIGHUP (jobs changed) and SIGTERM. Returns when
+ * there is nothing left to schedule, with the pid file emptied.
+ * @return SUCCESS, UNKNOWN if the daemon could not run or clear its pid
+ */
+int scheduler_run(int lock_fd){
+	sigset_t mask;
+	scheduler_signals(&mask);
+	signal(SIGCHLD, SIG_IGN); // players are reaped automatically
+
+	int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	int timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	struct job *heap = NULL;
+	int count = 0;
+	bool reload = true;
+	bool locked = true;
+	if(signal_fd == -1 || timer_fd == -1){
+		scheduler_clear_pid(lock_fd); // failing either way
+		return UNKNOWN;
+	}
+
+	while(1){
+		time_t now = time(NULL);
+		if(reload){
+			free(heap);
+			count = scheduler_load(&heap);
+			for(int i = 0; i < count; i++)
+				heap[i].when = scheduler_next(heap[i].hour, heap[i].minute, now);
+			heap_build(heap, count);
+			reload = false;
+		}
+		if(count == 0){
+			// unlock before looking again, so a job added meanwhile is never
+			// lost: either its notify starts a new daemon or it is seen here.
+			// The pid goes first, nobody may signal it once the lock is free
+			if(scheduler_clear_pid(lock_fd) != SUCCESS) break;
+			flock(lock_fd, LOCK_UN);
+			locked = false;
+			free(heap);
+			count = scheduler_load(&heap);
+			if(count == 0 || flock(lock_fd, LOCK_EX | LOCK_NB) == -1) break;
+			locked = true;
+			scheduler_write_pid(lock_fd);
+			reload = true;
+			continue;
+		}
+
+		// play every alarm that is due and move it to the next day
+		while(heap[0].when <= now){
+			scheduler_fire(&heap[0]);
+			heap[0].when = scheduler_next(heap[0].hour, heap[0].minute, now);
+			heap_sift_down(heap, count, 0);
+		}
+
+		// an absolute timer that is cancelled if the wall clock is set
+		struct itimerspec timer;
+		memset(&timer, 0, sizeof(timer));
+		timer.it_value.tv_sec = heap[0].when;
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &timer, NULL);
+
+		struct pollfd fds[2] = { { timer_fd, POLLIN, 0 }, { signal_fd, POLLIN, 0 } };
+		if(poll(fds, 2, -1) == -1) continue;
+
+		if(fds[0].revents & POLLIN){
+			uint64_t expirations;
+			if(read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno == ECANCELED)
+				reload = true; // clock changed, recompute every alarm
+		}
+		if(fds[1].revents & POLLIN){
+			struct signalfd_siginfo info;
+			if(read(signal_fd, &info, sizeof(info)) == sizeof(info)){
+				if(info.ssi_signo == SIGTERM) break;
+				reload = true;
+			}
+		}
+	}
+
+	int status = locked ? scheduler_clear_pid(lock_fd) : SUCCESS;
+	free(heap);
+	close(timer_fd);
+	close(signal_fd);
+	return status;
+}
+
+/**
+ * Make the daemon pick up the job file, starting it if it is not running
+ */
+void scheduler_notify(){
+	char pid_name[PATH_MAX];
+	scheduler_path(pid_name, sizeof(pid_name), ".pid");
+
+	int lock_fd = open(pid_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(lock_fd == -1) return;
+
+	if(flock(lock_fd, LOCK_EX | LOCK_NB) == -1){
+		// a daemon holds the lock, tell it to reload
+		char pid[32] = "";
+		if(pread(lock_fd, pid, sizeof(pid) - 1, 0) > 0 && atoi(pid) > 0)
+			kill(atoi(pid), SIGHUP);
+		close(lock_fd);
+		return;
+	}
+	// a daemon that died without cleaning up may have left its pid, which
+	// could belong to another process by now
+	if(scheduler_clear_pid(lock_fd) != SUCCESS){
+		close(lock_fd);
+		return;
+	}
+
+	pid_t pid = fork();
+	if(pid == 0){
+		// detach from the shell with a second fork, the lock is inherited
+		setsid();
+		if(fork() != 0) _exit(0);
+
+		for(int fd = 0; fd < 1024; fd++)
+			if(fd != lock_fd) close(fd);
+		open("/dev/null", O_RDWR);
+		dup2(0, 1);
+		dup2(0, 2);
+		if(chdir("/") == -1) _exit(1);
+
+		sigset_t mask;
+		scheduler_signals(&mask);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		if(scheduler_write_pid(lock_fd) != SUCCESS || scheduler_run(lock_fd) != SUCCESS)
+			_exit(1);
+		_exit(0);
+	}
+	if(pid > 0)
+		waitpid(pid, NULL, 0);
+	close(lock_fd);
+}
+
+/**
+ * Add an alarm and return its id, existing alarms are kept
+ */
+int scheduler_add(int hour, int minute, char *music_file){
+	char file_name[PATH_MAX];
+	char full_path[PATH_MAX];
+	char line[PATH_MAX+64];
+	int id = 1;
+
+	scheduler_path(file_name, sizeof(file_name), "");
+	FILE *file = fopen(file_name, "a+");
+	if(file == NULL){
+		printf("Cannot open file: %s\n", file_name);
+		return -1;
+	}
+	flock(fileno(file), LOCK_EX);
+
+	while(fgets(line, sizeof(line), file) != NULL){
+		int job_id;
+		if(sscanf(line, "%d", &job_id) == 1 && job_id >= id)
+			id = job_id + 1;
+	}
+
+	// the daemon runs in /, so keep the absolute path of the music
+	if(realpath(music_file, full_path) == NULL)
+		snprintf(full_path, sizeof(full_path), "%s", music_file);
+	fprintf(file, "%d %d %d %s\n", id, hour, minute, full_path);
+
+	fclose(file);
+	return id;
+}
+
+/**
+ * Print the alarms with the time they go off next
+ */
+int scheduler_list(){
+	struct job *jobs;
+	int count = scheduler_load(&jobs);
+	time_t now = time(NULL);
+
+	if(count == 0)
+		printf("No alarms set\n");
+	for(int i = 0; i < count; i++){
+		char when[64];
+		time_t next = scheduler_next(jobs[i].hour, jobs[i].minute, now);
+		strftime(when, sizeof(when), "%a %H:%M", localtime(&next));
+		printf("%d\t%02d.%02d\t(next: %s)\t%s\n", jobs[i].id, jobs[i].hour, jobs[i].minute, when, jobs[i].file);
+	}
+
+	free(jobs);
+	return SUCCESS;
+}
+
+/**
+ * Remove an alarm by id
+ */
+int scheduler_cancel(int id){
+	char file_name[PATH_MAX];
+	scheduler_path(file_name, sizeof(file_name), "");
+
+	FILE *file = fopen(file_name, "r+");
+	if(file == NULL){
+		printf("No alarm with id %d\n", id);
+		return SUCCESS;
+	}
+	flock(fileno(file), LOCK_EX);
+
+	char *kept = NULL;
+	size_t kept_len = 0;
+	FILE *out = open_memstream(&kept, &kept_len);
+	char line[PATH_MAX+64];
+	bool found = false;
+	while(fgets(line, sizeof(line), file) != NULL){
+		int job_id;
+		if(sscanf(line, "%d", &job_id) == 1 && job_id == id)
+			found = true;
+		else
+			fputs(line, out);
+	}
+	fclose(out);
+
+	if(found){
+		// rewrite in place so the lock stays on the same file
+		rewind(file);
+		if(ftruncate(fileno(file), 0) == 0)
+			fwrite(kept, 1, kept_len, file);
+	} else {
+		printf("No alarm with id %d\n", id);
+	}
+
+	free(kept);
+	fclose(file);
+	return SUCCESS;
+}
+
+/**
+ * Resource accounting for the commands run in this session. For every
+ * command name the wall time of each run is kept for percentiles, the rest
+ * is summed up. Histogram bucket i counts runs that took [2^i, 2^(i+1)) us.
+ */
+#define STATS_BUCKETS 26
+struct command_stats {
+	char name[64];
+	long runs;
+	double *wall_ms;
+	long wall_cap;
+	double user_ms;
+	double sys_ms;
+	double parse_ms;
+	double spawn_ms;
+	long max_rss_kb;
+	long minor_faults;
+	long major_faults;
+	long histogram[STATS_BUCKETS];
+};
+static struct command_stats *stats;
+static int stats_count = 0;
+static bool stats_verbose = false; // print a time line after each command
+double last_parse_ms = 0;
+
+double now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+double timeval_ms(struct timeval tv){
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/**
+ * Account a finished command
+ * @param command  the command
+ * @param wall_ms  time from fork to the end of wait4
+ * @param spawn_ms time fork took in the parent
+ * @param usage    resource usage of the child returned by wait4
+ */
+void stats_record(struct command_t *command, double wall_ms, double spawn_ms, struct rusage *usage){
+	struct command_stats *s = NULL;
+	for(int i = 0; i < stats_count; i++)
+		if(strcmp(stats[i].name, command->name) == 0)
+			s = &stats[i];
+	if(s == NULL){
+		stats = realloc(stats, sizeof(struct command_stats) * (stats_count + 1));
+		s = &stats[stats_count++];
+		memset(s, 0, sizeof(struct command_stats));
+		snprintf(s->name, sizeof(s->name), "%s", command->name);
+	}
+
+	if(s->runs == s->wall_cap){
+		s->wall_cap = s->wall_cap ? s->wall_cap * 2 : 16;
+		s->wall_ms = realloc(s->wall_ms, sizeof(double) * s->wall_cap);
+	}
+	s->wall_ms[s->runs++] = wall_ms;
+	s->user_ms += timeval_ms(usage->ru_utime);
+	s->sys_ms += timeval_ms(usage->ru_stime);
+	s->parse_ms += last_parse_ms;
+	s->spawn_ms += spawn_ms;
+	if(usage->ru_maxrss > s->max_rss_kb)
+		s->max_rss_kb = usage->ru_maxrss;
+	s->minor_faults += usage->ru_minflt;
+	s->major_faults += usage->ru_majflt;
+
+	int bucket = 0;
+	for(double us = wall_ms * 1000; us >= 2 && bucket < STATS_BUCKETS - 1; us /= 2)
+		bucket++;
+	s->histogram[bucket]++;
+
+	if(stats_verbose)
+		fprintf(stderr, "%s: real %.3fms user %.3fms sys %.3fms maxrss %ldKB faults %ld/%ld parse %.3fms spawn %.3fms\n",
+			command->name, wall_ms, timeval_ms(usage->ru_utime), timeval_ms(usage->ru_stime),
+			usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt, last_parse_ms, spawn_ms);
+}
+
+int compare_doubles(const void *a, const void *b){
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Nearest-rank percentile of a sorted array
+ */
+double percentile(double *sorted, long count, double p){
+	long rank = (long)(p / 100.0 * count + 0.999999);
+	if(rank < 1) rank = 1;
+	if(rank > count) rank = count;
+	return sorted[rank - 1];
+}
+
+/**
+ * Print s as a JSON string. Names are whatever was typed at the prompt,
+ * typos with quotes or control characters included.
+ */
+void json_print_string(FILE *out, const char *s){
+	fputc('"', out);
+	for(; *s; s++){
+		unsigned char c = *s;
+		if(c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+/**
+ * Print the stats as a table followed by a histogram per command, or as
+ * JSON with one line per command when json is set
+ */
+void stats_print(FILE *out, bool json){
+	if(json)
+		fprintf(out, "{\"commands\": [\n");
+	else
+		fprintf(out, "%-12s %6s %10s %10s %10s %10s %10s %10s %10s %10s %8s %8s\n", "command", "runs",
+			"mean(ms)", "p50", "p90", "p99", "max", "user", "sys", "maxrss(KB)", "minflt", "majflt");
+
+	for(int i = 0; i < stats_count; i++){
+		struct command_stats *s = &stats[i];
+		double *sorted = malloc(sizeof(double) * s->runs);
+		double total = 0;
+		memcpy(sorted, s->wall_ms, sizeof(double) * s->runs);
+		qsort(sorted, s->runs, sizeof(double), compare_doubles);
+		for(long j = 0; j < s->runs; j++)
+			total += sorted[j];
+
+		if(json){
+			fprintf(out, "  {\"name\": ");
+			json_print_string(out, s->name);
+			fprintf(out, ", \"runs\": %ld, \"wall_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}, "
+				"\"user_ms\": %.4f, \"sys_ms\": %.4f, \"parse_ms\": %.4f, \"spawn_ms\": %.4f, \"max_rss_kb\": %ld, \"minor_faults\": %ld, \"major_faults\": %ld, \"histogram_us_log2\": [",
+				s->runs, total / s->runs, percentile(sorted, s->runs, 50), percentile(sorted, s->runs, 90),
+				percentile(sorted, s->runs, 99), sorted[s->runs - 1], s->user_ms, s->sys_ms, s->parse_ms, s->spawn_ms,
+				s->max_rss_kb, s->minor_faults, s->major_faults);
+			for(int b = 0; b < STATS_BUCKETS; b++)
+				fprintf(out, "%s%ld", b ? ", " : "", s->histogram[b]);
+			fprintf(out, "]}%s\n", i < stats_count - 1 ? "," : "");
+		} else {
+			fprintf(out, "%-12s %6ld %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10ld %8ld %8ld\n",
+				s->name, s->runs, total / s->runs, percentile(sorted, s->runs, 50), percentile(sorted, s->runs, 90),
+				percentile(sorted, s->runs, 99), sorted[s->runs - 1], s->user_ms, s->sys_ms,
+				s->max_rss_kb, s->minor_faults, s->major_faults);
+		}
+		free(sorted);
+	}
+
+	if(json){
+		fprintf(out, "]}\n");
+		return;
+	}
+
+	for(int i = 0; i < stats_count; i++){
+		struct command_stats *s = &stats[i];
+		int first = 0, last = STATS_BUCKETS - 1;
+		long peak = 0;
+		while(s->histogram[first] == 0) first++;
+		while(s->histogram[last] == 0) last--;
+		for(int b = first; b <= last; b++)
+			if(s->histogram[b] > peak) peak = s->histogram[b];
+
+		fprintf(out, "\n%s (avg parse %.3fms, avg spawn %.3fms)\n", s->name, s->parse_ms / s->runs, s->spawn_ms / s->runs);
+		for(int b = first; b <= last; b++){
+			fprintf(out, "  %10.3fms | ", (1 << b) / 1000.0);
+			for(long j = 0; j < s->histogram[b] * 40 / peak; j++)
+				fputc('#', out);
+			fprintf(out, " %ld\n", s->histogram[b]);
+		}
+	}
+}
+
+/**
+ * The stats builtin
+ *   stats               table and histograms of this session
+ *   stats -j [file]     the same as JSON, to stdout or a file
+ *   stats on|off        print resource usage after every command
+ *   stats reset         forget everything recorded so far
+ */
+int stats_command(struct command_t *command){
+	if(command->arg_count == 0){
+		stats_print(stdout, false);
+	} else if(strcmp(command->args[0], "-j") == 0){
+		FILE *out = stdout;
+		if(command->arg_count > 1 && (out = fopen(command->args[1], "w")) == NULL){
+			printf("-%s: %s: %s: %s\n", sysname, command->name, command->args[1], strerror(errno));
+			return SUCCESS;
+		}
+		stats_print(out, true);
+		if(out != stdout)
+			fclose(out);
+	} else if(strcmp(command->args[0], "on") == 0 || strcmp(command->args[0], "off") == 0){
+		stats_verbose = strcmp(command->args[0], "on") == 0;
+	} else if(strcmp(command->args[0], "reset") == 0){
+		for(int i = 0; i < stats_count; i++)
+			free(stats[i].wall_ms);
+		free(stats);
+		stats = NULL;
+		stats_count = 0;
+	} else {
+		printf("Invalid arguments\n");
+	}
+	return SUCCESS;
+}
+
+/**
+ * Read-ahead engine used by the input layer. Each file gets a few large
+ * buffers that are kept in flight at consecutive offsets, so the disk is
+ * busy while a builtin works on the data it already has. Reads go through
+ * a private io_uring when the kernel allows it and through a small shared
+ * pool of pread threads otherwise (or when SEASHELL_NO_IO_URING is set).
+ */
+#define READAHEAD_BUFFERS 4
+#define READAHEAD_SIZE (1024 * 1024)
+#define READ_POOL_THREADS 4
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+};
+#endif
+
+struct readahead {
+	int fd;
+	bool use_uring;
+#ifdef HAVE_IO_URING
+	struct uring ring;
+#endif
+	pthread_mutex_t lock; // protects ready/results in thread pool mode
+	pthread_cond_t cond;
+	char *buffers[READAHEAD_BUFFERS];
+	off_t offsets[READAHEAD_BUFFERS];
+	ssize_t results[READAHEAD_BUFFERS];
+	bool submitted[READAHEAD_BUFFERS];
+	bool ready[READAHEAD_BUFFERS];
+	int head; // buffer the reader consumes next
+	size_t pos; // read position in the head buffer
+	off_t next_offset; // offset of the next buffer to submit
+};
+
+#ifdef HAVE_IO_URING
+int uring_init(struct uring *ring, unsigned entries){
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd < 0) return -1;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP){
+		if(ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ptr
+		: mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED){
+		if(ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+		if(ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+		if(ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+	return 0;
+}
+
+void uring_free(struct uring *ring){
+	munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+int uring_submit_read(struct uring *ring, int fd, char *buf, unsigned len, off_t offset, int tag){
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	long r;
+	do
+		r = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+	while(r == -1 && errno == EINTR);
+	if(r == 1) return 0;
+	// not consumed by the kernel, take it back so it is never submitted later
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	return -1;
+}
+
+/**
+ * Wait for the next completion
+ * @param tag    set to the tag the read was submitted with
+ * @param result set to what read() would have returned, -errno on error
+ */
+int uring_wait(struct uring *ring, int *tag, int *result){
+	while(1){
+		unsigned head = *ring->cq_head;
+		if(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			*tag = cqe->user_data;
+			*result = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		if(syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+			return -1;
+	}
+}
+
+#endif
+
+/**
+ * Threads shared by all files read without io_uring
+ */
+struct read_request {
+	struct readahead *ra;
+	int index;
+};
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct read_request *queue;
+	int start;
+	int len;
+	int cap;
+	int threads;
+} read_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0 };
+
+void *read_pool_worker(void *arg){
+	(void)arg;
+	while(1){
+		pthread_mutex_lock(&read_pool.lock);
+		while(read_pool.start == read_pool.len)
+			pthread_cond_wait(&read_pool.cond, &read_pool.lock);
+		struct read_request request = read_pool.queue[read_pool.start++];
+		if(read_pool.start == read_pool.len)
+			read_pool.start = read_pool.len = 0;
+		pthread_mutex_unlock(&read_pool.lock);
+
+		struct readahead *ra = request.ra;
+		int i = request.index;
+		ssize_t n;
+		do
+			n = pread(ra->fd, ra->buffers[i], READAHEAD_SIZE, ra->offsets[i]);
+		while(n == -1 && errno == EINTR);
+
+		pthread_mutex_lock(&ra->lock);
+		ra->results[i] = n < 0 ? -errno : n;
+		ra->ready[i] = true;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+	}
+	return NULL;
+}
+
+void read_pool_submit(struct readahead *ra, int index){
+	pthread_mutex_lock(&read_pool.lock);
+	while(read_pool.threads < READ_POOL_THREADS){
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, read_pool_worker, NULL) != 0) break;
+		pthread_detach(thread);
+		read_pool.threads++;
+	}
+	if(read_pool.len == read_pool.cap){
+		read_pool.cap = read_pool.cap ? read_pool.cap * 2 : 16;
+		read_pool.queue = realloc(read_pool.queue, sizeof(struct read_request) * read_pool.cap);
+	}
+	read_pool.queue[read_pool.len].ra = ra;
+	read_pool.queue[read_pool.len].index = index;
+	read_pool.len++;
+	pthread_cond_signal(&read_pool.cond);
+	pthread_mutex_unlock(&read_pool.lock);
+}
+
+void readahead_submit(struct readahead *ra, int i){
+	ra->offsets[i] = ra->next_offset;
+	ra->next_offset += READAHEAD_SIZE;
+	ra->submitted[i] = true;
+	ra->ready[i] = false;
+	if(!ra->use_uring){
+		read_pool_submit(ra, i);
+		return;
+	}
+#ifdef HAVE_IO_URING
+	if(uring_submit_read(&ra->ring, ra->fd, ra->buffers[i], READAHEAD_SIZE, ra->offsets[i], i) == 0)
+		return;
+#endif
+
+	// the ring is full or out of resources, read this one synchronously
+	ssize_t n = pread(ra->fd, ra->buffers[i], READAHEAD_SIZE, ra->offsets[i]);
+	ra->results[i] = n < 0 ? -errno : n;
+	ra->ready[i] = true;
+}
+
+void readahead_wait(struct readahead *ra, int i){
+	if(!ra->use_uring){
+		pthread_mutex_lock(&ra->lock);
+		while(!ra->ready[i])
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		pthread_mutex_unlock(&ra->lock);
+		return;
+	}
+
+#ifdef HAVE_IO_URING
+	// with io_uring only this thread touches the engine, no locking needed
+	while(!ra->ready[i]){
+		int tag;
+		int result;
+		if(uring_wait(&ra->ring, &tag, &result) == -1){
+			// the ring broke, finish this read synchronously
+			tag = i;
+			result = pread(ra->fd, ra->buffers[i], READAHEAD_SIZE, ra->offsets[i]);
+			if(result < 0) result = -errno;
+		} else if(result == -EINVAL){
+			// kernels before 5.6 have no IORING_OP_READ
+			result = pread(ra->fd, ra->buffers[tag], READAHEAD_SIZE, ra->offsets[tag]);
+			if(result < 0) result = -errno;
+		}
+		ra->results[tag] = result;
+		ra->ready[tag] = true;
+	}
+#endif
+}
+
+/**
+ * Start reading a file from the beginning
+ */
+struct readahead *readahead_open(int fd){
+	struct readahead *ra = calloc(1, sizeof(struct readahead));
+	ra->fd = fd;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+#ifdef HAVE_IO_URING
+	ra->use_uring = getenv("SEASHELL_NO_IO_URING") == NULL && uring_init(&ra->ring, READAHEAD_BUFFERS) == 0;
+#endif
+	for(int i = 0; i < READAHEAD_BUFFERS; i++)
+		ra->buffers[i] = malloc(READAHEAD_SIZE);
+	for(int i = 0; i < READAHEAD_BUFFERS; i++)
+		readahead_submit(ra, i);
+	return ra;
+}
+
+/**
+ * read() replacement, returns data in file order
+ */
+ssize_t readahead_read(struct readahead *ra, char *buf, size_t size){
+	while(1){
+		int i = ra->head;
+		if(!ra->submitted[i])
+			return 0;
+		readahead_wait(ra, i);
+		ssize_t result = ra->results[i];
+		if(result < 0){
+			errno = -result;
+			return -1;
+		}
+		if(ra->pos < (size_t)result){
+			size_t len = result - ra->pos;
+			if(len > size) len = size;
+			memcpy(buf, ra->buffers[i] + ra->pos, len);
+			ra->pos += len;
+			return len;
+		}
+
+		// buffer used up, reuse it for the next part of the file
+		ra->pos = 0;
+		ra->head = (i + 1) % READAHEAD_BUFFERS;
+		if(result == READAHEAD_SIZE){
+			readahead_submit(ra, i);
+			continue;
+		}
+
+		// a short read is normally the end of the file; the reads behind it
+		// were for the wrong offsets, so collect them and start over there
+		for(int j = 0; j < READAHEAD_BUFFERS; j++)
+			if(ra->submitted[j])
+				readahead_wait(ra, j);
+		memset(ra->submitted, 0, sizeof(ra->submitted));
+		if(result == 0)
+			return 0;
+		ra->next_offset = ra->offsets[i] + result;
+		for(int j = 0; j < READAHEAD_BUFFERS; j++)
+			readahead_submit(ra, (ra->head + j) % READAHEAD_BUFFERS);
+	}
+}
+
+/**
+ * Wait for the reads still in flight and release the engine, the file
+ * descriptor is left open
+ */
+void readahead_close(struct readahead *ra){
+	for(int i = 0; i < READAHEAD_BUFFERS; i++)
+		if(ra->submitted[i])
+			readahead_wait(ra, i);
+#ifdef HAVE_IO_URING
+	if(ra->use_uring)
+		uring_free(&ra->ring);
+#endif
+	for(int i = 0; i < READAHEAD_BUFFERS; i++)
+		free(ra->buffers[i]);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra);
+}
+
+ssize_t readahead_cookie_read(void *cookie, char *buf, size_t size){
+	return readahead_read(cookie, buf, size);
+}
+
+int readahead_cookie_close(void *cookie){
+	struct readahead *ra = cookie;
+	int fd = ra->fd;
+	readahead_close(ra);
+	return close(fd);
+}
+
+/**
+ * Input layer of highlight, unique and kdiff. Compressed files are
+ * recognized by their magic bytes and decoded while they are read: a
+ * decoder thread fills a ring of buffers that the builtin drains through
+ * an ordinary FILE *, so decoding overlaps with the builtin's own work and
+ * nothing is written to disk. Files larger than a read-ahead buffer are
+ * read through the read-ahead engine, small ones are opened as before.
+ */
+#define INPUT_CHUNKS 4
+#define INPUT_CHUNK_SIZE (256 * 1024)
+
+enum input_formats {
+	INPUT_PLAIN,
+	INPUT_GZIP,
+	INPUT_ZSTD,
+};
+
+struct input_stream {
+	int fd;
+	struct readahead *ra; // NULL for small files
+	int format;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *chunks[INPUT_CHUNKS];
+	size_t lengths[INPUT_CHUNKS];
+	int head; // chunk being read by the builtin
+	int count; // decoded chunks not read yet
+	size_t pos; // read position in the head chunk
+	bool done; // decoder finished, possibly with an error
+	bool failed;
+	bool closing; // reader went away, decoder should stop
+};
+
+/**
+ * Called by the decoder for every chunk it filled
+ * @return false if the reader closed the stream
+ */
+bool input_publish(struct input_stream *in, size_t len){
+	pthread_mutex_lock(&in->lock);
+	in->lengths[(in->head + in->count) % INPUT_CHUNKS] = len;
+	in->count++;
+	pthread_cond_broadcast(&in->cond);
+	while(in->count == INPUT_CHUNKS && !in->closing)
+		pthread_cond_wait(&in->cond, &in->lock);
+	bool closing = in->closing;
+	pthread_mutex_unlock(&in->lock);
+	return !closing;
+}
+
+ssize_t input_read_raw(struct input_stream *in, void *buf, size_t size){
+	if(in->ra)
+		return readahead_read(in->ra, buf, size);
+	return read(in->fd, buf, size);
+}
+
+/**
+ * Chunk the decoder fills next
+ */
+char *input_free_chunk(struct input_stream *in){
+	pthread_mutex_lock(&in->lock);
+	char *chunk = in->chunks[(in->head + in->count) % INPUT_CHUNKS];
+	pthread_mutex_unlock(&in->lock);
+	return chunk;
+}
+
+#ifdef HAVE_ZLIB
+bool input_decode_gzip(struct input_stream *in){
+	unsigned char src[65536];
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(inflateInit2(&zs, 15 + 32) != Z_OK) // 32: accept gzip and zlib headers
+		return false;
+
+	bool ok = true;
+	bool eof = false;
+	bool member_end = false; // the last inflate finished a gzip member
+	while(ok){
+		char *out = input_free_chunk(in);
+		zs.next_out = (unsigned char *)out;
+		zs.avail_out = INPUT_CHUNK_SIZE;
+		while(zs.avail_out > 0){
+			if(zs.avail_in == 0 && !eof){
+				ssize_t n = input_read_raw(in, src, sizeof(src));
+				if(n < 0){ ok = false; break; }
+				eof = n == 0;
+				zs.next_in = src;
+				zs.avail_in = n;
+			}
+			if(zs.avail_in == 0 && eof){
+				ok = member_end; // a file cut in the middle of a member is an error
+				break;
+			}
+			int ret = inflate(&zs, Z_NO_FLUSH);
+			member_end = ret == Z_STREAM_END;
+			if(ret == Z_STREAM_END)
+				inflateReset(&zs); // files may hold several gzip members
+			else if(ret != Z_OK){ ok = false; break; }
+		}
+		size_t len = INPUT_CHUNK_SIZE - zs.avail_out;
+		if(len == 0 || !input_publish(in, len)) break;
+	}
+	inflateEnd(&zs);
+	return ok;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+bool input_decode_zstd(struct input_stream *in){
+	char src[65536];
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	ZSTD_inBuffer zin = { src, 0, 0 };
+	bool ok = dctx != NULL;
+	bool eof = false;
+	bool frame_end = false; // the last call that made progress finished a frame
+	while(ok){
+		ZSTD_outBuffer zout = { input_free_chunk(in), INPUT_CHUNK_SIZE, 0 };
+		while(zout.pos < zout.size){
+			if(zin.pos == zin.size && !eof){
+				ssize_t n = input_read_raw(in, src, sizeof(src));
+				if(n < 0){ ok = false; break; }
+				eof = n == 0;
+				zin.size = n;
+				zin.pos = 0;
+			}
+			size_t in_pos = zin.pos;
+			size_t out_pos = zout.pos;
+			size_t ret = ZSTD_decompressStream(dctx, &zout, &zin);
+			if(ZSTD_isError(ret)){ ok = false; break; }
+			if(zin.pos != in_pos || zout.pos != out_pos)
+				frame_end = ret == 0;
+			// with all input consumed the decoder may still hold output,
+			// it is drained once a call leaves room in zout
+			if(zin.pos == zin.size && eof && zout.pos < zout.size){
+				ok = frame_end; // a file cut in the middle of a frame is an error
+				break;
+			}
+		}
+		if(zout.pos == 0 || !input_publish(in, zout.pos)) break;
+	}
+	ZSTD_freeDCtx(dctx);
+	return ok;
+}
+#endif
+
+void *input_decoder(void *arg){
+	struct input_stream *in = arg;
+	bool ok = false;
+#ifdef HAVE_ZLIB
+	if(in->format == INPUT_GZIP) ok = input_decode_gzip(in);
+#endif
+#ifdef HAVE_ZSTD
+	if(in->format == INPUT_ZSTD) ok = input_decode_zstd(in);
+#endif
+	pthread_mutex_lock(&in->lock);
+	in->done = true;
+	in->failed = !ok;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+	return NULL;
+}
+
+ssize_t input_read(void *cookie, char *buf, size_t size){
+	struct input_stream *in = cookie;
+
+	pthread_mutex_lock(&in->lock);
+	while(in->count == 0 && !in->done)
+		pthread_cond_wait(&in->cond, &in->lock);
+	if(in->count == 0){
+		bool failed = in->failed;
+		pthread_mutex_unlock(&in->lock);
+		if(failed){
+			errno = EIO;
+			return -1;
+		}
+		return 0;
+	}
+	pthread_mutex_unlock(&in->lock);
+
+	// the decoder never touches the head chunk, copy without the lock
+	size_t len = in->lengths[in->head] - in->pos;
+	if(len > size) len = size;
+	memcpy(buf, in->chunks[in->head] + in->pos, len);
+	in->pos += len;
+
+	if(in->pos == in->lengths[in->head]){
+		pthread_mutex_lock(&in->lock);
+		in->head = (in->head + 1) % INPUT_CHUNKS;
+		in->count--;
+		in->pos = 0;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->lock);
+	}
+	return len;
+}
+
+int input_close(void *cookie){
+	struct input_stream *in = cookie;
+
+	pthread_mutex_lock(&in->lock);
+	in->closing = true;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+	pthread_join(in->thread, NULL);
+
+	for(int i = 0; i < INPUT_CHUNKS; i++)
+		free(in->chunks[i]);
+	pthread_mutex_destroy(&in->lock);
+	pthread_cond_destroy(&in->cond);
+	if(in->ra)
+		readahead_close(in->ra);
+	close(in->fd);
+	free(in);
+	return 0;
+}
+
+/**
+ * Open a file for reading, decompressing gzip and zstd files on the fly
+ * @param  file_name  file to open
+ * @param  mode       fopen mode, "r" or "rb"
+ * @param  compressed set to whether the file was compressed, may be NULL
+ * @return            stream of the (decompressed) content, NULL on error
+ */
+FILE *input_open(char *file_name, char *mode, bool *compressed){
+	unsigned char magic[4] = { 0 };
+	int format = INPUT_PLAIN;
+
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) return NULL;
+	ssize_t n = pread(fd, magic, sizeof(magic), 0);
+	if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		format = INPUT_GZIP;
+	else if(n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		format = INPUT_ZSTD;
+	if(compressed)
+		*compressed = format != INPUT_PLAIN;
+
+	struct stat st;
+	bool large = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > READAHEAD_SIZE;
+	if(format == INPUT_PLAIN && !large)
+		return fdopen(fd, mode);
+	if(format == INPUT_PLAIN){
+		cookie_io_functions_t io = { .read = readahead_cookie_read, .write = NULL, .seek = NULL, .close = readahead_cookie_close };
+		struct readahead *ra = readahead_open(fd);
+		FILE *file = fopencookie(ra, mode, io);
+		if(file == NULL)
+			readahead_cookie_close(ra);
+		return file;
+	}
+
+#ifndef HAVE_ZLIB
+	if(format == INPUT_GZIP){
+		printf("%s: gzip support is not compiled in\n", file_name);
+		close(fd);
+		return NULL;
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if(format == INPUT_ZSTD){
+		printf("%s: zstd support is not compiled in\n", file_name);
+		close(fd);
+		return NULL;
+	}
+#endif
+
+	struct input_stream *in = calloc(1, sizeof(struct input_stream));
+	in->fd = fd;
+	if(large)
+		in->ra = readahead_open(fd);
+	in->format = format;
+	for(int i = 0; i < INPUT_CHUNKS; i++)
+		in->chunks[i] = malloc(INPUT_CHUNK_SIZE);
+	pthread_mutex_init(&in->lock, NULL);
+	pthread_cond_init(&in->cond, NULL);
+	cookie_io_functions_t io = { .read = input_read, .write = NULL, .seek = NULL, .close = input_close };
+	FILE *file = NULL;
+	if(pthread_create(&in->thread, NULL, input_decoder, in) == 0){
+		file = fopencookie(in, mode, io);
+		if(file == NULL)
+			input_close(in);
+		return file;
+	}
+
+	for(int i = 0; i < INPUT_CHUNKS; i++)
+		free(in->chunks[i]);
+	pthread_mutex_destroy(&in->lock);
+	pthread_cond_destroy(&in->cond);
+	if(in->ra)
+		readahead_close(in->ra);
+	free(in);
+	close(fd);
+	return NULL;
+}